@@ -0,0 +1,71 @@
+/* Splits a raw vector into lines, like readLines() on a rawConnection, but
+ * without the connection. Line endings are LF, CRLF or CR. The memchr() in
+ * libc is vectorised, so the scan itself runs at memory speed. */
+#include <string.h>
+#include <limits.h>
+#include <Rinternals.h>
+
+typedef struct {
+  const char * end;
+  const char * nl;  // next LF, or end
+  int has_cr;
+} scan_t;
+
+/* Length of the line starting at buf, and the size of its line ending. The
+ * position of the next LF is remembered, so text with only CR stays linear. */
+static R_xlen_t next_line(scan_t * scan, const char * buf, int * eol){
+  if(!scan->nl || scan->nl < buf){
+    scan->nl = memchr(buf, '\n', scan->end - buf);
+    if(!scan->nl)
+      scan->nl = scan->end;
+  }
+  R_xlen_t len = scan->nl - buf;
+  const char * cr = scan->has_cr ? memchr(buf, '\r', len) : NULL;
+  if(cr){
+    len = cr - buf;
+    *eol = (cr + 1 < scan->end && cr[1] == '\n') ? 2 : 1;
+  } else {
+    *eol = scan->nl < scan->end;
+  }
+  return len;
+}
+
+static cetype_t get_encoding(SEXP encoding){
+  const char * enc = CHAR(STRING_ELT(encoding, 0));
+  if(!strcmp(enc, "UTF-8") || !strcmp(enc, "UTF8") || !strcmp(enc, "utf8"))
+    return CE_UTF8;
+  if(!strcmp(enc, "latin1"))
+    return CE_LATIN1;
+  if(!strcmp(enc, "bytes"))
+    return CE_BYTES;
+  return CE_NATIVE;
+}
+
+/* Returns NULL if the data contains a NUL byte, which readLines() handles */
+SEXP R_as_text(SEXP x, SEXP n, SEXP encoding){
+  const char * buf = (const char *) RAW(x);
+  R_xlen_t size = XLENGTH(x);
+  R_xlen_t max = asReal(n) < 0 ? R_XLEN_T_MAX : asReal(n);
+  if(memchr(buf, '\0', size))
+    return R_NilValue;
+  scan_t scan = {buf + size, NULL, memchr(buf, '\r', size) != NULL};
+  cetype_t enc = get_encoding(encoding);
+
+  //count first, so the character vector is allocated only once
+  R_xlen_t count = 0;
+  int eol;
+  for(R_xlen_t pos = 0; pos < size && count < max; count++)
+    pos += next_line(&scan, buf + pos, &eol) + eol;
+  SEXP out = PROTECT(allocVector(STRSXP, count));
+  R_xlen_t pos = 0;
+  scan.nl = NULL;
+  for(R_xlen_t i = 0; i < count; i++){
+    R_xlen_t len = next_line(&scan, buf + pos, &eol);
+    if(len > INT_MAX)
+      Rf_error("Line %.0f is too long for a string", (double) i + 1);
+    SET_STRING_ELT(out, i, mkCharLenCE(buf + pos, len, enc));
+    pos += len + eol;
+  }
+  UNPROTECT(1);
+  return out;
+}
@@ -0,0 +1,303 @@
+/* Result cache for exec_internal(), see exec_cache() in R. An entry consists
+ * of the files KEY.out, KEY.err and KEY, which holds the exit status and is
+ * written last. Files are written under a temporary name and renamed, so they
+ * never change in place and can be mapped into memory by readers. A lock file
+ * in the cache directory keeps lookups out while entries are being evicted. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "exec.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+#define KEYLEN 16
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static uint64_t rotl(uint64_t x, int r){
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t * p){
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static uint32_t read32(const uint8_t * p){
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input){
+  acc += input * P2;
+  return rotl(acc, 31) * P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val){
+  acc ^= xxh_round(0, val);
+  return acc * P1 + P4;
+}
+
+/* XXH64 of a buffer, which hashes several GB per second */
+static uint64_t xxh64(const uint8_t * p, size_t len, uint64_t seed){
+  const uint8_t * end = p + len;
+  uint64_t h;
+  if(len >= 32){
+    uint64_t v[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+    do {
+      for(int i = 0; i < 4; i++, p += 8)
+        v[i] = xxh_round(v[i], read64(p));
+    } while(p <= end - 32);
+    h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    for(int i = 0; i < 4; i++)
+      h = xxh_merge(h, v[i]);
+  } else {
+    h = seed + P5;
+  }
+  h += len;
+  for(; p + 8 <= end; p += 8)
+    h = rotl(h ^ xxh_round(0, read64(p)), 27) * P1 + P4;
+  if(p + 4 <= end){
+    h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+    p += 4;
+  }
+  for(; p < end; p++)
+    h = rotl(h ^ (*p * P5), 11) * P1;
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+/* Hash of the content of a file, read through a mapping */
+static uint64_t hash_file(const char * path){
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  bail_if(fd < 0, "open stdin file for cache key");
+  struct stat info;
+  if(fstat(fd, &info) < 0 || info.st_size == 0){
+    close(fd);
+    return xxh64(NULL, 0, 0);
+  }
+  void * map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  bail_if(map == MAP_FAILED, "mmap() stdin file for cache key");
+  uint64_t h = xxh64(map, info.st_size, 0);
+  munmap(map, info.st_size);
+  return h;
+}
+
+/* Each string is prefixed with its length, so fields can not run into each
+ * other. The input is a file path or a raw vector. */
+SEXP R_cache_key(SEXP fields, SEXP input){
+  size_t len = 8;
+  for(int i = 0; i < Rf_length(fields); i++)
+    len += 8 + strlen(CHAR(STRING_ELT(fields, i)));
+  uint8_t * buf = (uint8_t *) R_alloc(len, 1);
+  uint8_t * p = buf;
+  for(int i = 0; i < Rf_length(fields); i++){
+    uint64_t n = strlen(CHAR(STRING_ELT(fields, i)));
+    memcpy(p, &n, 8);
+    memcpy(p + 8, CHAR(STRING_ELT(fields, i)), n);
+    p += 8 + n;
+  }
+  uint64_t h = TYPEOF(input) == RAWSXP ? xxh64(RAW(input), XLENGTH(input), 0) :
+    IS_STRING(input) ? hash_file(CHAR(STRING_ELT(input, 0))) : 0;
+  memcpy(p, &h, 8);
+  char key[KEYLEN + 1];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long) xxh64(buf, len, 0));
+  return mkString(key);
+}
+
+static int lock_cache(const char * dir, int op){
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/.lock", dir);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd < 0)
+    return -1;
+  while(flock(fd, op) < 0){
+    if(errno != EINTR){
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static void unlock_cache(int fd){
+  if(fd >= 0){
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+}
+
+/* Returns a list with status, stdout and stderr, or NULL for a miss */
+SEXP R_cache_lookup(SEXP dir, SEXP key){
+  const char * base = CHAR(STRING_ELT(dir, 0));
+  const char * id = CHAR(STRING_ELT(key, 0));
+  char path[PATH_MAX];
+  int lock = lock_cache(base, LOCK_SH);
+  if(lock < 0)
+    return R_NilValue;
+  char status[32] = "";
+  snprintf(path, sizeof(path), "%s/%s", base, id);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd >= 0){
+    ssize_t n = read(fd, status, sizeof(status) - 1);
+    status[n > 0 ? n : 0] = '\0';
+    close(fd);
+    utimensat(AT_FDCWD, path, NULL, 0);
+  }
+  int fds[2] = {-1, -1};
+  const char * ext[2] = {"out", "err"};
+  for(int i = 0; i < 2 && *status; i++){
+    snprintf(path, sizeof(path), "%s/%s.%s", base, id, ext[i]);
+    fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  unlock_cache(lock);
+
+  //the files stay readable after they are unlinked by an eviction
+  if(!*status || fds[0] < 0 || fds[1] < 0){
+    close_if(fds[0]);
+    close_if(fds[1]);
+    return R_NilValue;
+  }
+  const char * names[] = {"status", "stdout", "stderr", ""};
+  SEXP out = PROTECT(mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(out, 0, ScalarInteger(atoi(status)));
+  SET_VECTOR_ELT(out, 1, memfd_file(fds[0]));
+  SET_VECTOR_ELT(out, 2, memfd_file(fds[1]));
+  UNPROTECT(1);
+  return out;
+}
+
+static int write_file(const char * path, const void * data, size_t len){
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0)
+    return -1;
+  const char * p = data;
+  while(len > 0){
+    ssize_t n = write(fd, p, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0){
+      close(fd);
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return close(fd);
+}
+
+typedef struct {
+  char name[KEYLEN + 1];
+  double mtime;
+  double size;
+} entry_t;
+
+static int by_mtime(const void * a, const void * b){
+  double x = ((const entry_t *) a)->mtime;
+  double y = ((const entry_t *) b)->mtime;
+  return (x > y) - (x < y);
+}
+
+static void remove_entry(const char * dir, const char * name){
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/%s.out", dir, name);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/%s.err", dir, name);
+  unlink(path);
+}
+
+/* Removes the least recently used entries, other than the one that was just
+ * stored, until the cache fits in max_size. Called with the exclusive lock held. */
+static void evict(const char * dir, const char * keep, double max_size){
+  DIR * d = opendir(dir);
+  if(!d)
+    return;
+  int n = 0, cap = 64;
+  entry_t * entries = malloc(cap * sizeof(entry_t));
+  double total = 0;
+  struct dirent * ent;
+  while((ent = readdir(d))){
+    struct stat info;
+    if(strlen(ent->d_name) != KEYLEN || fstatat(dirfd(d), ent->d_name, &info, 0) < 0)
+      continue;
+    if(n == cap)
+      entries = realloc(entries, (cap *= 2) * sizeof(entry_t));
+    memcpy(entries[n].name, ent->d_name, KEYLEN + 1);
+    entries[n].mtime = info.st_mtim.tv_sec + info.st_mtim.tv_nsec * 1e-9;
+    entries[n].size = info.st_size;
+    for(int i = 0; i < 2; i++){
+      char file[KEYLEN + 5];
+      snprintf(file, sizeof(file), "%s.%s", ent->d_name, i ? "err" : "out");
+      if(fstatat(dirfd(d), file, &info, 0) == 0)
+        entries[n].size += info.st_size;
+    }
+    total += entries[n++].size;
+  }
+  closedir(d);
+  qsort(entries, n, sizeof(entry_t), by_mtime);
+  for(int i = 0; i < n && total > max_size; i++){
+    if(!strcmp(entries[i].name, keep))
+      continue;
+    remove_entry(dir, entries[i].name);
+    total -= entries[i].size;
+  }
+  free(entries);
+}
+
+/* Stores an entry, returns FALSE if that was not possible */
+SEXP R_cache_store(SEXP dir, SEXP key, SEXP status, SEXP out, SEXP err, SEXP max_size){
+  const char * base = CHAR(STRING_ELT(dir, 0));
+  const char * id = CHAR(STRING_ELT(key, 0));
+  const char * ext[3] = {"out", "err", ""};
+  SEXP data[2] = {out, err};
+  char tmp[3][PATH_MAX];
+  char text[32];
+  snprintf(text, sizeof(text), "%d", asInteger(status));
+  int ok = 1;
+  for(int i = 0; i < 3; i++){
+    snprintf(tmp[i], PATH_MAX, "%s/.tmp-%d-%s%s%s", base, (int) getpid(), id, *ext[i] ? "." : "", ext[i]);
+    const void * buf = i < 2 ? (const void *) RAW(data[i]) : text;
+    size_t len = i < 2 ? XLENGTH(data[i]) : strlen(text);
+    ok = ok && write_file(tmp[i], buf, len) == 0;
+  }
+  int lock = ok ? lock_cache(base, LOCK_EX) : -1;
+  for(int i = 0; i < 3; i++){
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s%s%s", base, id, *ext[i] ? "." : "", ext[i]);
+    if(lock < 0 || rename(tmp[i], path) < 0){
+      unlink(tmp[i]);
+      ok = 0;
+    }
+  }
+  if(lock >= 0)
+    evict(base, id, asReal(max_size));
+  unlock_cache(lock);
+  return ScalarLogical(ok);
+}
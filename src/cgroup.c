@@ -0,0 +1,225 @@
+/* Runs a command (or a whole pipeline) in a new cgroup v2 sub-group, which
+ * can have memory, cpu and io limits. Killing the group with cgroup.kill also
+ * reaches grandchildren, which signals to the child itself do not. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "exec.h"
+
+#ifdef __linux__
+
+static int write_file(int dir, const char * file, const char * value){
+  int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+  if(fd < 0)
+    return -1;
+  ssize_t n = write(fd, value, strlen(value));
+  int err = errno;
+  close(fd);
+  errno = err;
+  return n < 0 ? -1 : 0;
+}
+
+/* Reads a small file such as cpu.stat, returns 0 on failure */
+static size_t read_file(int dir, const char * file, char * buf, size_t len){
+  int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, len - 1);
+  close(fd);
+  buf[n > 0 ? n : 0] = '\0';
+  return n > 0 ? n : 0;
+}
+
+/* Value of a 'key value' line in a cgroup stat file, or NA */
+static double stat_value(const char * buf, const char * key){
+  size_t len = strlen(key);
+  for(const char * line = buf; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL){
+    if(!strncmp(line, key, len) && line[len] == ' ')
+      return atof(line + len + 1);
+  }
+  return NA_REAL;
+}
+
+/* Path of the cgroup of R: the cgroup2 mount plus the '0::' entry */
+static int own_cgroup(char * path, size_t len){
+  char line[PATH_MAX];
+  char mount[PATH_MAX] = "";
+  FILE * mounts = fopen("/proc/self/mounts", "r");
+  if(!mounts)
+    return -1;
+  while(fgets(line, sizeof(line), mounts)){
+    char dev[PATH_MAX], dir[PATH_MAX], type[64];
+    if(sscanf(line, "%s %s %63s", dev, dir, type) == 3 && !strcmp(type, "cgroup2")){
+      strcpy(mount, dir);
+      break;
+    }
+  }
+  fclose(mounts);
+  FILE * self = fopen("/proc/self/cgroup", "r");
+  if(!self || !*mount){
+    if(self)
+      fclose(self);
+    errno = ENOENT;
+    return -1;
+  }
+  int found = -1;
+  while(fgets(line, sizeof(line), self)){
+    if(!strncmp(line, "0::", 3)){
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(path, len, "%s%s", mount, line + 3);
+      found = 0;
+    }
+  }
+  fclose(self);
+  errno = ENOENT;
+  return found;
+}
+
+static void cgroup_fail(cgroup_t * cg, const char * what, const char * file){
+  int err = errno;
+  cgroup_remove(cg);
+  Rf_errorcall(R_NilValue, "Failed to %s cgroup %s (%s)", what, file, strerror(err));
+}
+
+/* Creates the group if the options have a 'cgroup' list, see exec_cgroup() */
+void cgroup_create(cgroup_t * cg, SEXP options){
+  static int counter = 0;
+  cg->dir = cg->procs = cg->parent = -1;
+  cg->name[0] = '\0';
+  SEXP config = get_option(options, "cgroup");
+  if(!Rf_length(config))
+    return;
+  char path[PATH_MAX];
+  SEXP parent = get_option(config, "parent");
+  if(IS_STRING(parent) && *CHAR(STRING_ELT(parent, 0))){
+    snprintf(path, sizeof(path), "%s", CHAR(STRING_ELT(parent, 0)));
+  } else {
+    bail_if(own_cgroup(path, sizeof(path)) < 0, "find cgroup v2 of R");
+  }
+  cg->parent = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(cg->parent < 0)
+    cgroup_fail(cg, "open", path);
+  snprintf(cg->name, sizeof(cg->name), "sys-%d-%d", (int) getpid(), ++counter);
+  if(mkdirat(cg->parent, cg->name, 0755) < 0)
+    cgroup_fail(cg, "create", cg->name);
+  cg->dir = openat(cg->parent, cg->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(cg->dir < 0)
+    cgroup_fail(cg, "open", cg->name);
+
+  //controllers must be enabled in the parent, which may not contain processes
+  const char * controllers[] = {"memory", "cpu", "io"};
+  const char * files[] = {"memory.max", "cpu.max", "io.max"};
+  for(int i = 0; i < 3; i++){
+    SEXP value = get_option(config, files[i]);
+    if(!IS_STRING(value))
+      continue;
+    char enable[32];
+    snprintf(enable, sizeof(enable), "+%s", controllers[i]);
+    if(write_file(cg->parent, "cgroup.subtree_control", enable) < 0)
+      cgroup_fail(cg, "enable controller in", path);
+    for(int k = 0; k < Rf_length(value); k++){
+      if(write_file(cg->dir, files[i], CHAR(STRING_ELT(value, k))) < 0)
+        cgroup_fail(cg, "set", files[i]);
+    }
+  }
+
+  //the child joins by writing its pid, and the descriptor must not be 0-2
+  cg->procs = openat(cg->dir, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+  if(cg->procs >= 0 && cg->procs <= 2){
+    int fd = fcntl(cg->procs, F_DUPFD_CLOEXEC, 3);
+    close(cg->procs);
+    cg->procs = fd;
+  }
+  if(cg->procs < 0)
+    cgroup_fail(cg, "open", "cgroup.procs");
+}
+
+/* Kills all processes in the group, returns -1 if that was not possible */
+int cgroup_kill(cgroup_t * cg){
+  if(cg->dir < 0)
+    return -1;
+  if(write_file(cg->dir, "cgroup.kill", "1") == 0)
+    return 0;
+  //kernels before 5.14 do not have cgroup.kill
+  char buf[4096];
+  if(!read_file(cg->dir, "cgroup.procs", buf, sizeof(buf)))
+    return -1;
+  for(char * p = buf; *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : p + strlen(p)){
+    pid_t pid = atoi(p);
+    if(pid > 0)
+      kill(pid, SIGKILL);
+  }
+  return 0;
+}
+
+/* Peak memory in bytes and cpu time in seconds of everything in the group */
+SEXP cgroup_stats(cgroup_t * cg){
+  if(cg->dir < 0)
+    return R_NilValue;
+  const char * names[] = {"memory_peak", "cpu_usage", "cpu_user", "cpu_system", ""};
+  SEXP res = PROTECT(mkNamed(REALSXP, names));
+  char buf[4096];
+  REAL(res)[0] = read_file(cg->dir, "memory.peak", buf, sizeof(buf)) ? atof(buf) : NA_REAL;
+  read_file(cg->dir, "cpu.stat", buf, sizeof(buf));
+  REAL(res)[1] = stat_value(buf, "usage_usec") / 1e6;
+  REAL(res)[2] = stat_value(buf, "user_usec") / 1e6;
+  REAL(res)[3] = stat_value(buf, "system_usec") / 1e6;
+  UNPROTECT(1);
+  return res;
+}
+
+/* Processes that the command left behind are killed, so the group can be
+ * removed. The kernel needs a moment to empty the group after the kill. */
+void cgroup_remove(cgroup_t * cg){
+  close_if(cg->procs);
+  cg->procs = -1;
+  if(cg->dir >= 0){
+    char buf[256];
+    for(int i = 0; i < 1000; i++){
+      if(!read_file(cg->dir, "cgroup.events", buf, sizeof(buf)) || stat_value(buf, "populated") == 0)
+        break;
+      if(i == 0)
+        cgroup_kill(cg);
+      struct timespec ts = {0, 1000000};
+      nanosleep(&ts, NULL);
+    }
+    close(cg->dir);
+    cg->dir = -1;
+  }
+  if(cg->parent >= 0){
+    if(*cg->name)
+      unlinkat(cg->parent, cg->name, AT_REMOVEDIR);
+    close(cg->parent);
+    cg->parent = -1;
+  }
+}
+
+#else
+
+void cgroup_create(cgroup_t * cg, SEXP options){
+  cg->dir = cg->procs = cg->parent = -1;
+  if(Rf_length(get_option(options, "cgroup")))
+    Rf_errorcall(R_NilValue, "Control groups are only supported on Linux");
+}
+
+int cgroup_kill(cgroup_t * cg){
+  return -1;
+}
+
+SEXP cgroup_stats(cgroup_t * cg){
+  return R_NilValue;
+}
+
+void cgroup_remove(cgroup_t * cg){}
+
+#endif
@@ -0,0 +1,213 @@
+/* Runs in the child after fork() or clone(), without R: this file is also
+ * part of the fork server helper program */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include "child.h"
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+#endif
+
+static void kill_process_group(int signum) {
+  kill(0, SIGKILL); // kills process group
+  raise(SIGKILL); // just to be sure
+}
+
+/* Order of the limits in limits_t */
+static const int rlimit_resources[NLIMITS] = {RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE};
+
+/* Runs in the child, returns -1 with errno set if a limit can not be applied */
+static int apply_limits(limits_t * limits){
+#ifdef __linux__
+  if(limits->has_cpus && syscall(SYS_sched_setaffinity, 0, sizeof(limits->cpus), limits->cpus) < 0)
+    return -1;
+#else
+  if(limits->has_cpus){
+    errno = ENOSYS;
+    return -1;
+  }
+#endif
+  if(limits->has_nice && setpriority(PRIO_PROCESS, 0, limits->nice) < 0)
+    return -1;
+#ifdef SYS_ioprio_set
+  //IOPRIO_WHO_PROCESS
+  if(limits->ioprio && syscall(SYS_ioprio_set, 1, 0, limits->ioprio) < 0)
+    return -1;
+#else
+  if(limits->ioprio){
+    errno = ENOSYS;
+    return -1;
+  }
+#endif
+  for(int i = 0; i < NLIMITS; i++){
+    struct rlimit rl = {limits->rlimit[i], limits->rlimit[i]};
+    if(limits->has_rlimit[i] && setrlimit(rlimit_resources[i], &rl) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* The pid is formatted by hand, because sprintf() is not async-signal-safe */
+static int join_cgroup(int fd){
+  char buf[16];
+  int pos = sizeof(buf);
+  for(pid_t pid = getpid(); pid > 0 || pos == sizeof(buf); pid /= 10)
+    buf[--pos] = '0' + pid % 10;
+  return write(fd, buf + pos, sizeof(buf) - pos) < 0 ? -1 : 0;
+}
+
+static int child_fail(spawn_t * s){
+  int err = errno;
+  if(write(s->failure, &err, sizeof(err)) < 0){}
+  close(s->failure);
+  return 127;
+}
+
+/* Make sure no descriptors other than stdin/stdout/stderr leak into the child.
+ * On Linux we mark them FD_CLOEXEC (which also covers the failure pipe) with a
+ * single close_range() call, or by listing /proc/self/fd on older kernels. This
+ * avoids one syscall per possible descriptor when 'ulimit -n' is very large. */
+#ifdef __linux__
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static int cloexec_proc_fds(void){
+  int dirfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(dirfd < 0)
+    return -1;
+  char buf[4096];
+  long n;
+  while((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0){
+    for(long pos = 0; pos < n;){
+      struct linux_dirent64 * d = (struct linux_dirent64 *) (buf + pos);
+      int fd = 0;
+      char * c = d->d_name;
+      for(; *c >= '0' && *c <= '9'; c++)
+        fd = fd * 10 + (*c - '0');
+      if(*c == '\0' && c != d->d_name && fd > 2 && fd != dirfd)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      pos += d->d_reclen;
+    }
+  }
+  close(dirfd);
+  return n < 0 ? -1 : 0;
+}
+#endif
+
+static void close_descriptors(spawn_t * s){
+#ifdef __linux__
+#ifdef SYS_close_range
+  if(syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+    return;
+#endif
+  if(cloexec_proc_fds() == 0)
+    return;
+#endif
+  //close all file descriptors before exit, otherwise they can segfault
+  for (int i = 3; i < s->maxfd; i++) {
+    if(i != s->failure){
+      int err = close(i);
+      if(i > 200 && err < 0)
+        break;
+    }
+  }
+}
+
+/* Runs in the child. With the vfork engine the child shares memory with the
+ * (suspended) parent, so only async-signal-safe calls are allowed here. */
+int child_exec(void * arg){
+  spawn_t * s = arg;
+
+  //do not run signal handlers of the parent before exec
+  struct sigaction sa;
+  for(int sig = 1; sig < NSIG; sig++){
+    if(sig != SIGKILL && sig != SIGSTOP && sigaction(sig, NULL, &sa) == 0 &&
+       sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL){
+      sa.sa_handler = SIG_DFL;
+      sigaction(sig, &sa, NULL);
+    }
+  }
+
+  //Linux only: set pgid and commit suicide when parent dies
+#ifdef PR_SET_PDEATHSIG
+  setpgid(0, 0);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  signal(SIGTERM, kill_process_group);
+#endif
+  //OSX: do NOT change pgid, so we receive signals from parent group
+
+  //undo blocking in child
+  sigdelset(&s->mask, SIGCHLD);
+  sigprocmask(SIG_SETMASK, &s->mask, NULL);
+
+  //affinity, priorities and resource limits are inherited by execvp()
+  if(apply_limits(&s->limits) < 0)
+    return child_fail(s);
+  if(s->cgroup > 2 && join_cgroup(s->cgroup) < 0)
+    return child_fail(s);
+
+  //map stdin/stdout/stderr
+  for(int i = 0; i < 3; i++){
+    int fd = s->fds[i];
+    if(fd < 0)
+      continue;
+    if(fd == i ? fcntl(fd, F_SETFD, 0) < 0 : dup2(fd, i) < 0)
+      return child_fail(s);
+  }
+
+  //execvp never returns if successful
+  fcntl(s->failure, F_SETFD, FD_CLOEXEC);
+  close_descriptors(s);
+  execvp(s->file, s->argv);
+
+  //execvp failed! Send errno to parent
+  return child_fail(s);
+}
+
+#ifdef __linux__
+int send_all(int fd, const void * buf, size_t len){
+  const char * p = buf;
+  while(len > 0){
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int recv_all(int fd, void * buf, size_t len){
+  char * p = buf;
+  while(len > 0){
+    ssize_t n = recv(fd, p, len, 0);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,57 @@
+/* Code that runs without R: in the spawned child, and in the fork server
+ * helper program (see forkserver/) which is built from child.c as well */
+#include <signal.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* Scheduling and resource limits, see exec_limits() in R. Plain data, so it
+ * can also be sent to the fork server. The rlimits are as, cpu_time, nofile. */
+#define MAX_CPUS 1024
+#define NLIMITS 3
+typedef struct {
+  int has_cpus;
+  unsigned long cpus[MAX_CPUS / (8 * sizeof(unsigned long))];
+  int has_nice;
+  int nice;
+  int ioprio;       // class << 13 | level, 0 to keep
+  int has_rlimit[NLIMITS];
+  rlim_t rlimit[NLIMITS];
+} limits_t;
+
+/* Everything the child needs, prepared by the parent before spawning */
+typedef struct {
+  const char * file;
+  char ** argv;
+  int fds[3];       // descriptors that become stdin/stdout/stderr, -1 to inherit
+  int failure;      // write end of the execvp errno pipe
+  int maxfd;
+  sigset_t mask;    // signal mask to restore in the child
+  limits_t limits;
+  int cgroup;       // cgroup.procs of the group to join if > 2, see cgroup.c
+} spawn_t;
+
+/* Fixed part of a request to the fork server, followed by the file, argv and
+ * environment as strings. Descriptors: the stdio fds that are present, failure
+ * pipe, cwd, and cgroup.procs if the child joins a cgroup. */
+typedef struct {
+  int argc;
+  int envc;
+  int hasfd[3];
+  int hascgroup;
+  int maxfd;
+  size_t len;
+  sigset_t mask;
+  limits_t limits;
+} request_t;
+
+typedef struct {
+  pid_t pid;
+  int err;
+} reply_t;
+
+#define NFDS 6
+
+int child_exec(void * arg);
+int send_all(int fd, const void * buf, size_t len);
+int recv_all(int fd, void * buf, size_t len);
@@ -0,0 +1,125 @@
+/* Compresses output with zlib while it is drained from the pipe, into a file
+ * or the chunks of a native capture. The output is in gzip format, so files
+ * can be read with gzfile(). All memory comes from R_alloc(), which R frees
+ * when the .Call returns, also after an error. Errors while the child runs
+ * are only recorded, the caller raises them after cleaning up. */
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#include "exec.h"
+
+#define ZIP_BUFSIZE 65536
+
+typedef struct {
+  z_stream zs;
+  int fd;           // output file, or -1 to capture in the stream
+  double size;      // compressed bytes
+  int error;        // errno of a failed write, or -1 if zlib failed
+  Bytef in[ZIP_BUFSIZE];
+  Bytef out[ZIP_BUFSIZE];
+} zip_t;
+
+static voidpf zip_alloc(voidpf opaque, uInt items, uInt size){
+  return R_alloc(items, size);
+}
+
+static void zip_free(voidpf opaque, voidpf address){}
+
+/* Only gzip is supported, there is no zstd in the R toolchains */
+int compress_enabled(SEXP options){
+  SEXP type = get_option(options, "compress");
+  if(!IS_STRING(type))
+    return 0;
+  if(strcmp(CHAR(STRING_ELT(type, 0)), "gzip"))
+    Rf_errorcall(R_NilValue, "Unsupported compression: %s", CHAR(STRING_ELT(type, 0)));
+  return 1;
+}
+
+/* Allocates all memory that zlib needs, so this must be called before the
+ * child is spawned: it raises an error if that fails */
+void * compress_new(void){
+  zip_t * zip = (zip_t *) R_alloc(1, sizeof(zip_t));
+  memset(zip, 0, sizeof(zip_t));
+  zip->fd = -1;
+  zip->zs.zalloc = zip_alloc;
+  zip->zs.zfree = zip_free;
+  //windowBits 15 + 16 writes a gzip header instead of zlib
+  if(deflateInit2(&zip->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    Rf_error("Failed to initialize zlib");
+  return zip;
+}
+
+void compress_init(stream_t * stream, void * zip, int fd){
+  ((zip_t *) zip)->fd = fd;
+  stream->zip = zip;
+  stream->limited = 0;
+}
+
+static int write_all(int fd, const Bytef * buf, size_t len){
+  while(len > 0){
+    ssize_t n = write(fd, buf, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void deflate_input(stream_t * stream, int flush){
+  zip_t * zip = stream->zip;
+  int res;
+  do {
+    zip->zs.next_out = zip->out;
+    zip->zs.avail_out = ZIP_BUFSIZE;
+    res = deflate(&zip->zs, flush);
+    if(res == Z_STREAM_ERROR){
+      zip->error = -1;
+      return;
+    }
+    size_t len = ZIP_BUFSIZE - zip->zs.avail_out;
+    zip->size += len;
+    if(zip->fd >= 0){
+      if(write_all(zip->fd, zip->out, len) < 0){
+        zip->error = errno;
+        return;
+      }
+    } else if(len){
+      capture_append(stream, zip->out, len);
+    }
+  } while (zip->zs.avail_out == 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+}
+
+/* Returns 0 after EOF, or when compressing failed and the child must stop */
+int compress_output(stream_t * stream){
+  zip_t * zip = stream->zip;
+  ssize_t len;
+  while(!zip->error && (len = stream_read(stream, zip->in, ZIP_BUFSIZE)) > 0){
+    zip->zs.next_in = zip->in;
+    zip->zs.avail_in = len;
+    deflate_input(stream, Z_NO_FLUSH);
+  }
+  return !zip->error && len != 0;
+}
+
+/* Writes the gzip trailer, after which the stream can not take more input */
+void compress_finish(stream_t * stream){
+  zip_t * zip = stream->zip;
+  zip->zs.next_in = NULL;
+  zip->zs.avail_in = 0;
+  if(!zip->error)
+    deflate_input(stream, Z_FINISH);
+  deflateEnd(&zip->zs);
+}
+
+/* The recorded error: an errno, -1 for zlib, or 0 */
+int compress_error(stream_t * stream){
+  return stream->zip ? ((zip_t *) stream->zip)->error : 0;
+}
+
+double compress_size(stream_t * stream){
+  return stream->zip ? ((zip_t *) stream->zip)->size : 0;
+}
@@ -3,42 +3,33 @@
 #define _GNU_SOURCE
 #endif
 
-#include <Rinternals.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
-#include <sys/time.h>
-#include <signal.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
+#include "exec.h"
 
 #ifdef __linux__
-#include <sys/prctl.h>
+#include <sys/syscall.h>
 #endif
 
 #define r 0
 #define w 1
-#define waitms 200
-#define IS_STRING(x) (Rf_isString(x) && Rf_length(x))
-#define IS_TRUE(x) (Rf_isLogical(x) && Rf_length(x) && asLogical(x))
-#define IS_FALSE(x) (Rf_isLogical(x) && Rf_length(x) && !asLogical(x))
-
-void kill_process_group(int signum) {
-  kill(0, SIGKILL); // kills process group
-  raise(SIGKILL); // just to be sure
-}
 
 /* prevent potential handlers from cleaning up exit codes */
-static void block_sigchld(void){
+void block_sigchld(void){
   sigset_t block_sigchld;
   sigemptyset(&block_sigchld);
   sigaddset(&block_sigchld, SIGCHLD);
   sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
 }
 
-static void resume_sigchild(void){
+void resume_sigchild(void){
   sigset_t block_sigchld;
   sigemptyset(&block_sigchld);
   sigaddset(&block_sigchld, SIGCHLD);
@@ -51,59 +42,65 @@ void bail_if(int err, const char * what){
     Rf_errorcall(R_NilValue, "System failure for: %s (%s)", what, strerror(errno));
 }
 
-/* In the fork we don't want to use the R API anymore */
-void print_if(int err, const char * what){
-  if(err){
-    FILE *stream = fdopen(STDERR_FILENO, "w");
-    if(stream){
-      fprintf(stream, "System failure for: %s (%s)\n", what, strerror(errno));
-      fclose(stream);
-    }
-  }
-}
-
 void warn_if(int err, const char * what){
   if(err)
     Rf_warningcall(R_NilValue, "System failure for: %s (%s)", what, strerror(errno));
 }
 
-void set_pipe(int input, int output[2]){
-  print_if(dup2(output[w], input) < 0, "dup2() stdout/stderr");
-  close(output[r]);
-  close(output[w]);
+void set_nonblock(int fd){
+  bail_if(fcntl(fd, F_SETFL, O_NONBLOCK) < 0, "fcntl() in set_nonblock");
 }
 
-void pipe_set_read(int pipe[2]){
-  close(pipe[w]);
-  bail_if(fcntl(pipe[r], F_SETFL, O_NONBLOCK) < 0, "fcntl() in pipe_set_read");
+/* Files for the child are opened in the parent so the child only needs dup2() */
+static int open_input(const char * file, int flags){
+  int fd = open(file, flags | O_CLOEXEC);
+  return fd < 0 ? -2 : fd;
 }
 
-void set_input(const char * file){
-  close(STDIN_FILENO);
-  int fd = open(file, O_RDONLY); //lowest numbered FD should be 0
-  print_if(fd != 0, "open() set_input not equal to STDIN_FILENO");
+/* Set STDIN for child (default is /dev/null). Returns -1 to inherit, or -2
+ * (with errno set) if the file can not be opened. */
+int try_open_stdin(SEXP input){
+  if(IS_FEED(input)){
+    //written to a pipe by C_execute
+    return -1;
+  } else if(IS_FALSE(input)){
+    //set stdin to unreadable /dev/null (O_WRONLY)
+    return open_input("/dev/null", O_WRONLY);
+  } else if(!IS_TRUE(input)){
+    return open_input(IS_STRING(input) ? CHAR(STRING_ELT(input, 0)) : "/dev/null", O_RDONLY);
+  }
+  return -1;
 }
 
-void set_output(int target, const char * file){
-  close(target);
-  int fd = open(file, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-  print_if(fd < 0, "open() set_output");
-  if(fd == target)
-    return;
-  print_if(fcntl(fd, F_DUPFD, target) < 0, "fcntl() set_output");
-  close(fd);
+int open_stdin(SEXP input){
+  int fd = try_open_stdin(input);
+  bail_if(fd == -2, "open() input file");
+  return fd;
 }
 
-void safe_close(int target){
-  set_output(target, "/dev/null");
+/* Returns -1 (with errno set) if the file can not be opened */
+int try_open_output(const char * file){
+  return open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
 }
 
-static void check_child_success(int fd, const char * cmd){
-  int child_errno;
-  int n = read(fd, &child_errno, sizeof(child_errno));
+int open_output(const char * file){
+  int fd = try_open_output(file);
+  bail_if(fd < 0, "open() output file");
+  return fd;
+}
+
+/* Returns the errno of a failed execvp(), or 0 on success */
+int child_errno(int fd){
+  int err = 0;
+  int n = read(fd, &err, sizeof(err));
   close(fd);
-  if (n) {
-    Rf_errorcall(R_NilValue, "Failed to execute '%s' (%s)", cmd, strerror(child_errno));
+  return n > 0 ? err : 0;
+}
+
+static void check_child_success(int fd, const char * cmd){
+  int err = child_errno(fd);
+  if (err) {
+    Rf_errorcall(R_NilValue, "Failed to execute '%s' (%s)", cmd, strerror(err));
   }
 }
 
@@ -116,147 +113,787 @@ int pending_interrupt(void) {
   return !(R_ToplevelExec(check_interrupt_fn, NULL));
 }
 
-int wait_for_action2(int fd1, int fd2){
-  short events = POLLIN | POLLERR | POLLHUP;
-  struct pollfd ufds[2] = {
-    {fd1, events, events},
-    {fd2, events, events}
-  };
-  return poll(ufds, 2, waitms);
+/* Monotonic clock in seconds, immune to changes of the wall clock */
+double timestamp(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* A pidfd becomes readable when the child exits (Linux 5.3+) */
+int open_pidfd(pid_t pid){
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+/* Resource usage of a child that was reaped with wait4() */
+SEXP make_rusage(struct rusage * ru, double elapsed){
+  const char * names[] = {"elapsed", "user", "system", "max_rss", "minor_faults", "major_faults",
+                          "voluntary_switches", "involuntary_switches", ""};
+  SEXP out = PROTECT(mkNamed(REALSXP, names));
+  double * x = REAL(out);
+  x[0] = elapsed;
+  x[1] = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec * 1e-6;
+  x[2] = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec * 1e-6;
+#ifdef __APPLE__
+  x[3] = ru->ru_maxrss;
+#else
+  x[3] = ru->ru_maxrss * 1024.0; //kilobytes on Linux and BSD
+#endif
+  x[4] = ru->ru_minflt;
+  x[5] = ru->ru_majflt;
+  x[6] = ru->ru_nvcsw;
+  x[7] = ru->ru_nivcsw;
+  UNPROTECT(1);
+  return out;
+}
+
+stats_t session_stats;
+
+SEXP R_exec_stats(SEXP reset){
+  const char * names[] = {"commands", "spawn_time", "reads", "bytes_read", "callbacks",
+                          "callback_time", "pipe_stalls", ""};
+  SEXP out = PROTECT(mkNamed(REALSXP, names));
+  double * x = REAL(out);
+  x[0] = session_stats.commands;
+  x[1] = session_stats.spawn_time;
+  x[2] = session_stats.reads;
+  x[3] = session_stats.bytes;
+  x[4] = session_stats.callbacks;
+  x[5] = session_stats.callback_time;
+  x[6] = session_stats.stalls;
+  if(asLogical(reset) == TRUE)
+    memset(&session_stats, 0, sizeof(session_stats));
+  UNPROTECT(1);
+  return out;
+}
+
+/* Timing of the phases of C_execute, relative to the start of the spawn */
+static SEXP make_trace(double spawned, double * phases, stream_t * out, stream_t * err){
+  const char * names[] = {"spawn", "exec", "first_stdout", "exit", "drain", "reads", "bytes_read",
+                          "callbacks", "callback_time", "pipe_stalls", ""};
+  SEXP res = PROTECT(mkNamed(REALSXP, names));
+  double * x = REAL(res);
+  for(int i = 0; i < 5; i++)
+    x[i] = phases[i] ? phases[i] - spawned : NA_REAL;
+  x[5] = out->reads + err->reads;
+  x[6] = out->bytes + err->bytes;
+  x[7] = out->callbacks + err->callbacks;
+  x[8] = out->callback_time + err->callback_time;
+  x[9] = out->stalls + err->stalls;
+  UNPROTECT(1);
+  return res;
 }
 
-static void R_callback(SEXP fun, const char * buf, ssize_t len){
-  if(!isFunction(fun)) return;
+static void R_call(stream_t * stream, SEXP arg){
   int ok;
+  double start = timestamp();
+  SEXP call = PROTECT(LCONS(stream->fun, LCONS(arg, R_NilValue)));
+  R_tryEval(call, R_GlobalEnv, &ok);
+  UNPROTECT(1);
+  double elapsed = timestamp() - start;
+  stream->callbacks++;
+  stream->callback_time += elapsed;
+  session_stats.callbacks++;
+  session_stats.callback_time += elapsed;
+}
+
+static void R_callback(stream_t * stream, const char * buf, ssize_t len){
+  if(!isFunction(stream->fun)) return;
   SEXP str = PROTECT(allocVector(RAWSXP, len));
   memcpy(RAW(str), buf, len);
-  SEXP call = PROTECT(LCONS(fun, LCONS(str, R_NilValue)));
-  R_tryEval(call, R_GlobalEnv, &ok);
-  UNPROTECT(2);
+  R_call(stream, str);
+  UNPROTECT(1);
 }
 
-void print_output(int pipe_out[2], SEXP fun){
-  static ssize_t len;
-  static char buffer[65336];
-  while ((len = read(pipe_out[r], buffer, sizeof(buffer))) > 0)
-    R_callback(fun, buffer, len);
+ssize_t stream_read(stream_t * stream, void * buf, size_t len){
+  ssize_t n;
+  if(stream->queued){
+    //the pipe was already read by io_uring, only the copy is left
+    if(!stream->datalen){
+      errno = EAGAIN;
+      return -1;
+    }
+    n = stream->datalen < len ? stream->datalen : len;
+    memcpy(buf, stream->data, n);
+    stream->data += n;
+    stream->datalen -= n;
+  } else {
+    n = read(stream->fd, buf, len);
+  }
+  stream->reads++;
+  session_stats.reads++;
+  if(n > 0){
+    if(!stream->bytes)
+      stream->first = timestamp();
+    stream->bytes += n;
+    session_stats.bytes += n;
+  }
+  return n;
 }
 
-SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SEXP wait, SEXP timeout){
-  //split process
-  int block = asLogical(wait);
-  int pipe_out[2];
-  int pipe_err[2];
-  int failure[2];
+/* Native capture never calls back into R. Chunks double in size (up to 1GB)
+ * so the number of allocations stays small and nothing gets copied until the
+ * chunks are concatenated by stream_value(). */
+#define MAX_CHUNKS 256
+#define DEFAULT_READ (1 << 20)
+#define MAX_PIPE (1 << 20)
 
-  //setup execvp errno pipe
-  bail_if(pipe(failure), "pipe(failure)");
+/* A callback with a 'framing' attribute (see frame_output() in R) gets whole
+ * lines or records, collected in batches. */
+static void framing_init(stream_t * stream, SEXP framing, SEXP protect, int i){
+  SEXP delim = get_option(framing, "delim");
+  stream->framing = Rf_length(delim) ? FRAME_DELIM : FRAME_RECORD;
+  stream->delim = Rf_length(delim) ? RAW(delim)[0] : 0;
+  stream->crlf = asLogical(get_option(framing, "crlf")) == TRUE;
+  stream->record = asInteger(get_option(framing, "record"));
+  stream->batch = asInteger(get_option(framing, "batch"));
+  stream->latency = asReal(get_option(framing, "latency"));
+  stream->store = SET_VECTOR_ELT(protect, i, allocVector(VECSXP, 2));
+  stream->buf = SET_VECTOR_ELT(stream->store, 0, allocVector(RAWSXP, 65536));
+  stream->records = R_NilValue;
+}
 
-  //create io pipes only in blocking mode
-  if(block){
-    bail_if(pipe(pipe_out) || pipe(pipe_err), "create pipe");
-    block_sigchld();
+void stream_init(stream_t * stream, int fd, SEXP fun, SEXP protect, int i){
+  memset(stream, 0, sizeof(stream_t));
+  stream->fd = fd;
+  stream->fun = fun;
+  stream->max_read = DEFAULT_READ;
+  if(IS_CAPTURE(fun)){
+    //the extra slot holds the ring buffer for the tail
+    stream->chunks = allocVector(VECSXP, MAX_CHUNKS + 1);
+    SET_VECTOR_ELT(protect, i, stream->chunks);
+  } else if(isFunction(fun) && getAttrib(fun, install("framing")) != R_NilValue){
+    framing_init(stream, getAttrib(fun, install("framing")), protect, i);
+  } else if(fd >= 0){
+    //the read buffer gets allocated on first use
+    stream->store = SET_VECTOR_ELT(protect, i, allocVector(VECSXP, 1));
   }
+}
 
-  //fork the main process
-  pid_t pid = fork();
-  bail_if(pid < 0, "fork()");
+/* Per call settings for the size of reads and the capacity of the pipe. Unless
+ * a size is given, a pipe that keeps running full grows up to MAX_PIPE. */
+void stream_config(stream_t * stream, SEXP options){
+  SEXP read_size = get_option(options, "read_size");
+  if(Rf_length(read_size) && asReal(read_size) >= 1)
+    stream->max_read = asReal(read_size);
+  SEXP limits = get_option(options, "capture_limits");
+  SEXP head = get_option(limits, "head");
+  SEXP tail = get_option(limits, "tail");
+  if(stream->chunks && (Rf_length(head) || Rf_length(tail))){
+    stream->limited = 1;
+    stream->head = Rf_length(head) ? asReal(head) : 0;
+    stream->tail = Rf_length(tail) ? asReal(tail) : 0;
+    stream->ring = SET_VECTOR_ELT(stream->chunks, MAX_CHUNKS, allocVector(RAWSXP, stream->tail ? stream->tail : 65536));
+  }
+#ifdef F_GETPIPE_SZ
+  if(stream->fd < 0)
+    return;
+  SEXP pipe_size = get_option(options, "pipe_size");
+  stream->max_pipe = MAX_PIPE;
+  if(Rf_length(pipe_size) && asInteger(pipe_size) > 0){
+    //may fail for unprivileged users above /proc/sys/fs/pipe-max-size
+    fcntl(stream->fd, F_SETPIPE_SZ, asInteger(pipe_size));
+    stream->max_pipe = 0;
+  }
+  stream->pipe_size = fcntl(stream->fd, F_GETPIPE_SZ);
+  if(stream->pipe_size < 0)
+    stream->pipe_size = 0;
+#endif
+}
 
-  //CHILD PROCESS
-  if(pid == 0){
-    if(block){
-      //undo blocking in child (is this needed at all?)
-      resume_sigchild();
+/* Draining a full pipe's worth of data at once means that the child was (or
+ * soon would have been) blocked in write() */
+static void check_pressure(stream_t * stream, double drained){
+  if(!stream->pipe_size || drained < stream->pipe_size)
+    return;
+  stream->stalls++;
+  session_stats.stalls++;
+#ifdef F_SETPIPE_SZ
+  if(stream->pipe_size < stream->max_pipe){
+    int size = fcntl(stream->fd, F_SETPIPE_SZ, 2 * stream->pipe_size);
+    if(size > stream->pipe_size){
+      stream->pipe_size = size;
+    } else {
+      stream->max_pipe = 0;
+    }
+  }
+#endif
+}
 
-      // send stdout/stderr to pipes
-      set_pipe(STDOUT_FILENO, pipe_out);
-      set_pipe(STDERR_FILENO, pipe_err);
+/* Once the head is full, reads go round in the ring buffer, so memory use
+ * stays the same however much the child writes */
+static ssize_t capture_tail(stream_t * stream){
+  R_xlen_t size = XLENGTH(stream->ring);
+  R_xlen_t pos = stream->after % size;
+  ssize_t len = stream_read(stream, RAW(stream->ring) + pos, size - pos);
+  if(len > 0)
+    stream->after += len;
+  return len;
+}
+
+typedef struct {
+  stream_t * stream;
+  R_xlen_t size;
+} chunk_alloc_t;
+
+static void alloc_chunk(void * data){
+  chunk_alloc_t * a = data;
+  SET_VECTOR_ELT(a->stream->chunks, a->stream->nchunks, allocVector(RAWSXP, a->size));
+}
+
+/* The last chunk, or a new one if that is full. Returns R_NilValue and sets
+ * 'overflow' when there is no more room, so that the caller can kill the
+ * child and clean up before raising an error. */
+static SEXP capture_chunk(stream_t * stream){
+  SEXP chunk = stream->nchunks ? VECTOR_ELT(stream->chunks, stream->nchunks - 1) : R_NilValue;
+  if(chunk == R_NilValue || stream->used == XLENGTH(chunk)){
+    if(stream->overflow)
+      return R_NilValue;
+    chunk_alloc_t a = {stream, (R_xlen_t) 65536 << (stream->nchunks < 14 ? stream->nchunks : 14)};
+    if(stream->limited && a.size > stream->head - stream->total)
+      a.size = stream->head - stream->total;
+    if(stream->nchunks == MAX_CHUNKS || !R_ToplevelExec(alloc_chunk, &a)){
+      stream->overflow = 1;
+      return R_NilValue;
+    }
+    chunk = VECTOR_ELT(stream->chunks, stream->nchunks++);
+    stream->used = 0;
+  }
+  return chunk;
+}
+
+/* Adds data that did not come from the pipe, such as compressed output */
+void capture_append(stream_t * stream, const void * data, R_xlen_t len){
+  while(len > 0){
+    SEXP chunk = capture_chunk(stream);
+    if(chunk == R_NilValue)
+      return;
+    R_xlen_t n = XLENGTH(chunk) - stream->used < len ? XLENGTH(chunk) - stream->used : len;
+    memcpy(RAW(chunk) + stream->used, data, n);
+    stream->used += n;
+    stream->total += n;
+    data = (const char *) data + n;
+    len -= n;
+  }
+}
+
+static int capture_output(stream_t * stream){
+  ssize_t len;
+  do {
+    if(stream->limited && stream->total == stream->head){
+      len = capture_tail(stream);
+      continue;
+    }
+    SEXP chunk = capture_chunk(stream);
+    if(chunk == R_NilValue)
+      return 0;
+    R_xlen_t room = XLENGTH(chunk) - stream->used;
+    if(stream->limited && room > stream->head - stream->total)
+      room = stream->head - stream->total;
+    len = stream_read(stream, RAW(chunk) + stream->used, room);
+    if(len > 0){
+      stream->used += len;
+      stream->total += len;
+    }
+  } while (len > 0);
+  return len != 0;
+}
+
+/* Deliver complete records. The records vector is handed to R so it can not
+ * be reused afterwards. */
+static void flush_records(stream_t * stream, int eof){
+  if(stream->framing == FRAME_DELIM){
+    if(!stream->nrecords)
+      return;
+    SEXP lines = stream->records;
+    if(stream->nrecords < XLENGTH(lines)){
+      lines = PROTECT(allocVector(STRSXP, stream->nrecords));
+      for(int i = 0; i < stream->nrecords; i++)
+        SET_STRING_ELT(lines, i, STRING_ELT(stream->records, i));
     } else {
-      //redirect stdout in background process
-      if(IS_STRING(outfun)){
-        set_output(STDOUT_FILENO, CHAR(STRING_ELT(outfun, 0)));
-      } else if(!IS_TRUE(outfun)){
-        safe_close(STDOUT_FILENO);
-      }
-      //redirect stderr in background process
-      if(IS_STRING(errfun)){
-        set_output(STDERR_FILENO, CHAR(STRING_ELT(errfun, 0)));
-      } else if(!IS_TRUE(errfun)){
-        safe_close(STDERR_FILENO);
-      }
+      PROTECT(lines);
+      stream->records = SET_VECTOR_ELT(stream->store, 1, R_NilValue);
+    }
+    stream->nrecords = 0;
+    R_call(stream, lines);
+    UNPROTECT(1);
+  } else {
+    R_xlen_t max = stream->record * stream->batch;
+    R_xlen_t pos = 0;
+    while(pos < stream->buflen){
+      R_xlen_t len = stream->buflen - pos;
+      if(len > max)
+        len = max;
+      else if(!eof)
+        len = len / stream->record * stream->record;
+      if(!len)
+        break;
+      SEXP data = PROTECT(allocVector(RAWSXP, len));
+      memcpy(RAW(data), RAW(stream->buf) + pos, len);
+      R_call(stream, data);
+      UNPROTECT(1);
+      pos += len;
     }
+    memmove(RAW(stream->buf), RAW(stream->buf) + pos, stream->buflen - pos);
+    stream->buflen -= pos;
+  }
+  stream->since = 0;
+}
 
-    //Linux only: set pgid and commit suicide when parent dies
-#ifdef PR_SET_PDEATHSIG
-    setpgid(0, 0);
-    prctl(PR_SET_PDEATHSIG, SIGTERM);
-    signal(SIGTERM, kill_process_group);
-#endif
-    //OSX: do NOT change pgid, so we receive signals from parent group
-
-    // Set STDIN for child (default is /dev/null)
-    if(IS_FALSE(input)){
-      //set stdin to unreadable /dev/null (O_WRONLY)
-      safe_close(STDIN_FILENO);
-    } else if(!IS_TRUE(input)){
-      set_input(IS_STRING(input) ? CHAR(STRING_ELT(input, 0)) : "/dev/null");
+/* Lines keep their encoding unknown, as with readLines(). An embedded nul
+ * truncates the line because R strings can not contain it. */
+static void add_record(stream_t * stream, const char * start, R_xlen_t len){
+  if(stream->crlf && len && start[len - 1] == '\r')
+    len--;
+  const char * nul = memchr(start, 0, len);
+  if(nul)
+    len = nul - start;
+
+  //grows up to 'batch' records, so a large batch only costs memory when used
+  int size = Rf_length(stream->records);
+  if(stream->nrecords == size){
+    int grow = size ? 2 * size : 64;
+    SEXP records = allocVector(STRSXP, grow < stream->batch ? grow : stream->batch);
+    for(int i = 0; i < stream->nrecords; i++)
+      SET_STRING_ELT(records, i, STRING_ELT(stream->records, i));
+    stream->records = SET_VECTOR_ELT(stream->store, 1, records);
+  }
+  SET_STRING_ELT(stream->records, stream->nrecords++, mkCharLenCE(start, len, CE_NATIVE));
+  if(stream->nrecords == 1)
+    stream->since = timestamp();
+  if(stream->nrecords == stream->batch)
+    flush_records(stream, 0);
+}
+
+/* Split the bytes in the buffer from 'from' onwards */
+static void split_records(stream_t * stream, R_xlen_t from){
+  if(stream->framing == FRAME_DELIM){
+    char * data = (char *) RAW(stream->buf);
+    char * start = data;
+    char * end = data + stream->buflen;
+    char * p = data + from;
+    while((p = memchr(p, stream->delim, end - p))){
+      add_record(stream, start, p - start);
+      start = ++p;
+    }
+    stream->buflen = end - start;
+    memmove(data, start, stream->buflen);
+  } else {
+    if(!stream->since && stream->buflen >= stream->record)
+      stream->since = timestamp();
+    if(stream->buflen >= stream->record * stream->batch)
+      flush_records(stream, 0);
+  }
+}
+
+static int frame_output(stream_t * stream){
+  ssize_t len;
+  do {
+    R_xlen_t size = XLENGTH(stream->buf);
+    if(size - stream->buflen < 65536){
+      SEXP buf = allocVector(RAWSXP, 2 * size);
+      memcpy(RAW(buf), RAW(stream->buf), stream->buflen);
+      stream->buf = SET_VECTOR_ELT(stream->store, 0, buf);
     }
+    len = stream_read(stream, RAW(stream->buf) + stream->buflen, XLENGTH(stream->buf) - stream->buflen);
+    if(len > 0){
+      R_xlen_t from = stream->buflen;
+      stream->buflen += len;
+      split_records(stream, from);
+    }
+  } while (len > 0);
+  return len != 0;
+}
 
-    //close all file descriptors before exit, otherwise they can segfault
-    for (int i = 3; i < sysconf(_SC_OPEN_MAX); i++) {
-      if(i != failure[w]){
-        int err = close(i);
-        if(i > 200 && err < 0)
-          break;
-      }
+/* The buffer doubles when a read fills it, up to the max read size */
+static int callback_output(stream_t * stream){
+  ssize_t len;
+  SEXP buf = VECTOR_ELT(stream->store, 0);
+  if(buf == R_NilValue)
+    buf = SET_VECTOR_ELT(stream->store, 0, allocVector(RAWSXP, stream->max_read < 65536 ? stream->max_read : 65536));
+  while ((len = stream_read(stream, RAW(buf), XLENGTH(buf))) > 0){
+    R_callback(stream, (char *) RAW(buf), len);
+    if(len == XLENGTH(buf) && len < stream->max_read)
+      buf = SET_VECTOR_ELT(stream->store, 0, allocVector(RAWSXP, 2 * len < stream->max_read ? 2 * len : stream->max_read));
+  }
+  return len != 0;
+}
+
+/* Returns 0 once the pipe has reached EOF */
+int print_output(stream_t * stream){
+  if(stream->fd < 0)
+    return 0;
+  double before = stream->bytes;
+  int res = stream->zip ? compress_output(stream) :
+    stream->chunks ? capture_output(stream) :
+    stream->framing ? frame_output(stream) : callback_output(stream);
+  check_pressure(stream, stream->bytes - before);
+  return res;
+}
+
+/* Earliest of 'deadline' and the time when waiting records must be delivered */
+double stream_deadline(stream_t * stream, double deadline){
+  if(stream->since && stream->since + stream->latency < deadline)
+    return stream->since + stream->latency;
+  return deadline;
+}
+
+void stream_tick(stream_t * stream, double now){
+  if(stream->since && now >= stream->since + stream->latency)
+    flush_records(stream, 0);
+}
+
+/* After EOF: an unterminated last line or partial record is delivered too */
+void stream_finish(stream_t * stream){
+  if(stream->zip)
+    compress_finish(stream);
+  if(stream->framing == FRAME_DELIM && stream->buflen){
+    add_record(stream, (char *) RAW(stream->buf), stream->buflen);
+    stream->buflen = 0;
+  }
+  if(stream->framing)
+    flush_records(stream, 1);
+}
+
+/* Bytes that were read but did not fit in the head or tail */
+double stream_dropped(stream_t * stream){
+  return stream->after > stream->tail ? stream->after - stream->tail : 0;
+}
+
+/* Concatenates the captured chunks and resets the stream, so it can capture
+ * more output afterwards */
+SEXP stream_value(stream_t * stream){
+  SEXP out;
+  R_xlen_t kept = stream->after < stream->tail ? stream->after : stream->tail;
+  if(stream->nchunks == 1 && !kept && stream->used == XLENGTH(VECTOR_ELT(stream->chunks, 0))){
+    out = VECTOR_ELT(stream->chunks, 0);
+  } else {
+    out = allocVector(RAWSXP, stream->total + kept);
+    R_xlen_t pos = 0;
+    for(int i = 0; i < stream->nchunks; i++){
+      SEXP chunk = VECTOR_ELT(stream->chunks, i);
+      R_xlen_t len = i == stream->nchunks - 1 ? stream->used : XLENGTH(chunk);
+      memcpy(RAW(out) + pos, RAW(chunk), len);
+      SET_VECTOR_ELT(stream->chunks, i, R_NilValue);
+      pos += len;
     }
+    //the oldest byte of a full ring is at the write position
+    if(kept){
+      R_xlen_t start = stream->after > stream->tail ? stream->after % stream->tail : 0;
+      memcpy(RAW(out) + pos, RAW(stream->ring) + start, kept - start);
+      memcpy(RAW(out) + pos + kept - start, RAW(stream->ring), start);
+    }
+  }
+  stream->nchunks = 0;
+  stream->used = 0;
+  stream->total = 0;
+  stream->after = 0;
+  return out;
+}
 
-    //prepare execv
-    int len = Rf_length(args);
-    char * argv[len + 1];
-    argv[len] = NULL;
-    for(int i = 0; i < len; i++){
-      argv[i] = strdup(CHAR(STRING_ELT(args, i)));
+void feed_init(feed_t * feed, int fd, SEXP source, SEXP protect, int i){
+  feed->fd = fd;
+  feed->source = source;
+  feed->chunk = TYPEOF(source) == RAWSXP ? source : allocVector(RAWSXP, 0);
+  feed->pos = 0;
+  feed->protect = protect;
+  feed->i = i;
+  feed->failed = 0;
+  SET_VECTOR_ELT(protect, i, feed->chunk);
+}
+
+/* Don't let R's SIGPIPE handler fire when the child closed its stdin */
+static ssize_t write_nosigpipe(int fd, const void * buf, size_t len){
+  sigset_t pipeset, old, pending;
+  sigemptyset(&pipeset);
+  sigaddset(&pipeset, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &pipeset, &old);
+  ssize_t n = write(fd, buf, len);
+  if(n < 0 && errno == EPIPE){
+    int sig;
+    sigpending(&pending);
+    if(sigismember(&pending, SIGPIPE))
+      sigwait(&pipeset, &sig);
+    errno = EPIPE;
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  return n;
+}
+
+/* Returns 0 once all input is written or the child stopped reading */
+int write_input(feed_t * feed){
+  while(1){
+    if(feed->pos == XLENGTH(feed->chunk)){
+      if(!isFunction(feed->source))
+        return 0;
+      int ok;
+      SEXP call = PROTECT(LCONS(feed->source, R_NilValue));
+      SEXP chunk = R_tryEval(call, R_GlobalEnv, &ok);
+      UNPROTECT(1);
+      if(!ok)
+        feed->failed = 1;
+      if(!ok || TYPEOF(chunk) != RAWSXP || XLENGTH(chunk) == 0)
+        return 0;
+      feed->chunk = SET_VECTOR_ELT(feed->protect, feed->i, chunk);
+      feed->pos = 0;
     }
+    ssize_t len = write_nosigpipe(feed->fd, RAW(feed->chunk) + feed->pos, XLENGTH(feed->chunk) - feed->pos);
+    if(len < 0)
+      return errno == EAGAIN || errno == EINTR;
+    feed->pos += len;
+  }
+}
 
-    //execvp never returns if successful
-    fcntl(failure[w], F_SETFD, FD_CLOEXEC);
-    execvp(CHAR(STRING_ELT(command, 0)), argv);
+void close_if(int fd){
+  if(fd > 2)
+    close(fd);
+}
 
-    //execvp failed! Send errno to parent
-    print_if(write(failure[w], &errno, sizeof(errno)) < 0, "write to failure pipe");
-    close(failure[w]);
+/* Only valid until the end of the .Call */
+char ** prepare_argv(SEXP args){
+  int len = Rf_length(args);
+  char ** argv = (char **) R_alloc(len + 1, sizeof(char *));
+  argv[len] = NULL;
+  for(int i = 0; i < len; i++){
+    argv[i] = (char *) CHAR(STRING_ELT(args, i));
+  }
+  return argv;
+}
+
+/* Opens the files for the child, and those for compressed output. Returns what
+ * failed (with errno set) or NULL. The descriptors that were opened are kept
+ * in 'spec' and 'zipfd' either way, so the caller can close them. */
+static const char * open_redirections(spawn_t * spec, int * zipfd, SEXP input, SEXP outfun, SEXP errfun,
+                                      SEXP captures, int block, int compress){
+  spec->fds[STDIN_FILENO] = try_open_stdin(input);
+  if(spec->fds[STDIN_FILENO] == -2)
+    return "open() input file";
+  if(compress && IS_STRING(outfun) && (zipfd[0] = try_open_output(CHAR(STRING_ELT(outfun, 0)))) < 0)
+    return "open() output file";
+  if(compress && IS_STRING(errfun) && (zipfd[1] = try_open_output(CHAR(STRING_ELT(errfun, 0)))) < 0)
+    return "open() output file";
+
+  //the child writes directly to output files, also in blocking mode
+  int * out = &spec->fds[STDOUT_FILENO];
+  int * err = &spec->fds[STDERR_FILENO];
+  if(IS_STRING(outfun) && !compress){
+    if((*out = try_open_output(CHAR(STRING_ELT(outfun, 0)))) < 0)
+      return "open() output file";
+  } else if(!block && !IS_TRUE(outfun)){
+    if((*out = try_open_output("/dev/null")) < 0)
+      return "open() output file";
+  } else if(VECTOR_ELT(captures, 3) != R_NilValue){
+    if((*out = memfd_child(VECTOR_ELT(captures, 3))) < 0)
+      return "fcntl() dup memfd";
+  }
+  if(IS_STRING(outfun) && IS_STRING(errfun) && !compress && !strcmp(CHAR(STRING_ELT(outfun, 0)), CHAR(STRING_ELT(errfun, 0)))){
+    //share the file offset, otherwise stdout and stderr overwrite each other
+    if((*err = fcntl(*out, F_DUPFD_CLOEXEC, 0)) < 0)
+      return "fcntl() dup output file";
+  } else if(IS_STRING(errfun) && !compress){
+    if((*err = try_open_output(CHAR(STRING_ELT(errfun, 0)))) < 0)
+      return "open() output file";
+  } else if(!block && !IS_TRUE(errfun)){
+    if((*err = try_open_output("/dev/null")) < 0)
+      return "open() output file";
+  } else if(VECTOR_ELT(captures, 4) != R_NilValue){
+    if((*err = memfd_child(VECTOR_ELT(captures, 4))) < 0)
+      return "fcntl() dup memfd";
+  }
+  return NULL;
+}
 
-    //exit() not allowed by CRAN. raise() should suffice
-    //exit(EXIT_FAILURE);
-    raise(SIGKILL);
+/* The execvp errno pipe, and in blocking mode the pipes for the streams that
+ * are not redirected. Returns what failed or NULL, as open_redirections(). */
+const char * open_pipes(spawn_t * spec, int * failure, int * pipe_out, int * pipe_err,
+                        int * pipe_in, SEXP input, int block){
+  if(pipe(failure) < 0)
+    return "pipe(failure)";
+  spec->failure = failure[w];
+  if(!block)
+    return NULL;
+  if(spec->fds[STDOUT_FILENO] < 0){
+    if(pipe(pipe_out) < 0)
+      return "create pipe";
+    spec->fds[STDOUT_FILENO] = pipe_out[w];
+  }
+  if(spec->fds[STDERR_FILENO] < 0){
+    if(pipe(pipe_err) < 0)
+      return "create pipe";
+    spec->fds[STDERR_FILENO] = pipe_err[w];
   }
+  if(IS_FEED(input)){
+    if(pipe(pipe_in) < 0)
+      return "create pipe";
+    spec->fds[STDIN_FILENO] = pipe_in[r];
+  }
+  return NULL;
+}
+
+SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SEXP wait, SEXP timeout, SEXP options){
+  //split process
+  int block = asLogical(wait);
+  int pipe_out[2] = {-1, -1};
+  int pipe_err[2] = {-1, -1};
+  int pipe_in[2] = {-1, -1};
+  int failure[2] = {-1, -1};
+  spawn_t spec = {CHAR(STRING_ELT(command, 0)), prepare_argv(args), {-1, -1, -1}, -1, sysconf(_SC_OPEN_MAX)};
+
+  //compressed output files are written by the parent, the child gets a pipe
+  int compress = block && compress_enabled(options);
+  if(compress && IS_STRING(outfun) && IS_STRING(errfun) && !strcmp(CHAR(STRING_ELT(outfun, 0)), CHAR(STRING_ELT(errfun, 0))))
+    Rf_errorcall(R_NilValue, "Can not compress stdout and stderr into the same file");
+  void * zips[2] = {NULL, NULL};
+  if(compress && (IS_CAPTURE(outfun) || IS_STRING(outfun)))
+    zips[0] = compress_new();
+  if(compress && (IS_CAPTURE(errfun) || IS_STRING(errfun)))
+    zips[1] = compress_new();
+
+  //with memfd capture the child writes to a file in memory instead of a pipe
+  SEXP captures = PROTECT(allocVector(VECSXP, 5));
+  SEXP capture = get_option(options, "capture");
+  if(block && !compress && IS_STRING(capture) && !strcmp(CHAR(STRING_ELT(capture, 0)), "memfd")){
+    if(IS_CAPTURE(outfun))
+      SET_VECTOR_ELT(captures, 3, memfd_new());
+    if(IS_CAPTURE(errfun))
+      SET_VECTOR_ELT(captures, 4, memfd_new());
+  }
+
+  //a cgroup is only used when waiting, because it gets removed afterwards. It
+  //is created before anything is opened, so its errors can not leak anything.
+  cgroup_t cg = {-1, -1, -1, ""};
+  if(block)
+    cgroup_create(&cg, options);
+  spec.cgroup = cg.procs;
+
+  //open all redirections and pipes, the error is raised after closing the ones that worked
+  int zipfd[2] = {-1, -1};
+  const char * failed = open_redirections(&spec, zipfd, input, outfun, errfun, captures, block, compress);
+  if(!failed)
+    failed = open_pipes(&spec, failure, pipe_out, pipe_err, pipe_in, input, block);
+  if(block)
+    block_sigchld();
+
+  //spawn the child process
+  int trace = IS_TRUE(get_option(options, "trace"));
+  double phases[5] = {0};
+  double spawned = timestamp();
+  pid_t pid = -1;
+  if(!failed && (pid = spawn_child(&spec, options)) < 0)
+    failed = "fork()";
+  if(failed){
+    int err = errno;
+    close_if(spec.fds[STDIN_FILENO]);
+    close_if(spec.fds[STDOUT_FILENO]);
+    close_if(spec.fds[STDERR_FILENO]);
+    close_if(failure[r]);
+    close_if(failure[w]);
+    close_if(pipe_out[r]);
+    close_if(pipe_err[r]);
+    close_if(pipe_in[w]);
+    close_if(zipfd[0]);
+    close_if(zipfd[1]);
+    cgroup_remove(&cg);
+    if(block)
+      resume_sigchild();
+    errno = err;
+    bail_if(1, failed);
+  }
+  phases[0] = timestamp();
+  close_if(cg.procs);
+  cg.procs = -1;
+  close_if(spec.fds[STDIN_FILENO]);
+  close_if(spec.fds[STDOUT_FILENO]);
+  close_if(spec.fds[STDERR_FILENO]);
 
   //PARENT PROCESS:
   close(failure[w]);
   if (!block){
     check_child_success(failure[r], CHAR(STRING_ELT(command, 0)));
+    UNPROTECT(1);
     return ScalarInteger(pid);
   }
 
-  //blocking: close write end of IO pipes
-  pipe_set_read(pipe_out);
-  pipe_set_read(pipe_err);
+  //blocking: poll the read end of IO pipes
+  if(pipe_out[r] >= 0)
+    set_nonblock(pipe_out[r]);
+  if(pipe_err[r] >= 0)
+    set_nonblock(pipe_err[r]);
+
+  //output goes to R callbacks or gets captured natively
+  stream_t out, err;
+  stream_init(&out, pipe_out[r], outfun, captures, 0);
+  stream_init(&err, pipe_err[r], errfun, captures, 1);
+  stream_config(&out, options);
+  stream_config(&err, options);
+  if(zips[0])
+    compress_init(&out, zips[0], zipfd[0]);
+  if(zips[1])
+    compress_init(&err, zips[1], zipfd[1]);
+
+  //stdin data gets written whenever the pipe has room
+  feed_t in;
+  if(pipe_in[w] >= 0){
+    set_nonblock(pipe_in[w]);
+    feed_init(&in, pipe_in[w], input, captures, 2);
+  }
+
+  //the pidfd wakes up poll() as soon as the child exits
+  int pidfd = open_pidfd(pid);
+  struct pollfd ufds[5] = {
+    {pipe_out[r], POLLIN, 0},
+    {pipe_err[r], POLLIN, 0},
+    {pidfd, POLLIN, 0},
+    {pipe_in[w], POLLOUT, 0},
+    {trace ? failure[r] : -1, POLLIN, 0}
+  };
+
+  //with tracing, the failure pipe tells when execvp() has succeeded
+  if(trace && poll(ufds + 4, 1, 0) > 0){
+    phases[1] = timestamp();
+    ufds[4].fd = -1;
+  }
 
   //start timer
-  struct timeval start, end;
-  double elapsed, totaltime = REAL(timeout)[0];
-  gettimeofday(&start, NULL);
+  double totaltime = REAL(timeout)[0];
+  double start = timestamp();
+  double now = start;
+  double elapsed = 0;
+  double next_check = start;
+  int backoff = 1;
+
+  //a child that writes more than the cap in total gets killed. Only captured
+  //output counts, which is what capture_limits() bounds the memory of.
+  SEXP max_output = get_option(get_option(options, "capture_limits"), "max");
+  double maxbytes = Rf_length(max_output) ? asReal(max_output) : 0;
+  int capped = 0;
 
   //status -1 means error, 0 means running
   int status = 0;
   int killcount = 0;
-  while (waitpid(pid, &status, WNOHANG) >= 0){
-    //check for timeout
+  int input_failed = 0;
+  int wait_errno = 0;
+  pid_t waited;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  while ((waited = wait4(pid, &status, WNOHANG, &usage)) <= 0){
+    //the child is gone if it can not be waited for, raise after cleanup
+    if(waited < 0){
+      if(errno == EINTR)
+        continue;
+      wait_errno = errno;
+      break;
+    }
+
+    //check for timeout, a cgroup kills the entire process tree at once
     if(totaltime > 0){
-      gettimeofday(&end, NULL);
-      elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
-      if(killcount == 0 && elapsed > totaltime){
+      if(killcount == 0 && elapsed > totaltime && cgroup_kill(&cg) == 0){
+        killcount = 2;
+      } else if(killcount == 0 && elapsed > totaltime){
         warn_if(kill(pid, SIGINT), "interrupt child");
         killcount++;
       } else if(killcount == 1 && elapsed > (totaltime + 1)){
@@ -266,31 +903,147 @@ SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SE
     }
 
     //for well behaved programs, SIGINT is automatically forwarded
-    if(pending_interrupt()){
-      //pass interrupt to child. On second try we SIGKILL.
-      warn_if(kill(pid, killcount ? SIGKILL : SIGINT), "kill child");
-      killcount++;
+    if(now >= next_check){
+      next_check = now + waitms / 1000.0;
+      if(pending_interrupt()){
+        //pass interrupt to child. On second try we SIGKILL.
+        if(!killcount || cgroup_kill(&cg) < 0)
+          warn_if(kill(pid, killcount ? SIGKILL : SIGINT), "kill child");
+        killcount++;
+      }
+    }
+
+    //sleep until there is output, the child exits, or the next deadline
+    double deadline = next_check;
+    if(totaltime > 0 && killcount < 2 && start + totaltime + killcount < deadline)
+      deadline = start + totaltime + killcount;
+    deadline = stream_deadline(&out, stream_deadline(&err, deadline));
+    int ms = deadline > now ? (deadline - now) * 1000 + 1 : 0;
+
+    //without pidfd we can only learn about the exit by polling waitpid()
+    if(pidfd < 0 && ms > backoff){
+      ms = backoff;
+      backoff = backoff * 2 > waitms ? waitms : backoff * 2;
+    }
+    if(poll(ufds, 5, ms) > 0)
+      backoff = 1;
+    if(ufds[4].fd >= 0 && ufds[4].revents){
+      phases[1] = timestamp();
+      ufds[4].fd = -1;
+    }
+
+    //close stdin once everything was written so the child sees EOF
+    if(ufds[3].fd >= 0 && ufds[3].revents && !write_input(&in)){
+      input_failed = in.failed;
+      close(pipe_in[w]);
+      ufds[3].fd = pipe_in[w] = -1;
     }
-    //make sure to empty the pipes, even if fun == NULL
-    wait_for_action2(pipe_out[r], pipe_err[r]);
 
-    //print stdout/stderr buffers
-    print_output(pipe_out, outfun);
-    print_output(pipe_err, errfun);
+    //print stdout/stderr buffers, stop polling pipes after EOF
+    if(ufds[0].fd >= 0 && !print_output(&out))
+      ufds[0].fd = -1;
+    if(ufds[1].fd >= 0 && !print_output(&err))
+      ufds[1].fd = -1;
+    //no room for the output: kill the child, the error is raised after cleanup
+    int stopped = out.overflow || err.overflow || compress_error(&out) || compress_error(&err);
+    if(stopped && killcount < 2){
+      if(cgroup_kill(&cg) < 0)
+        warn_if(kill(pid, SIGKILL), "kill child");
+      killcount = 2;
+    }
+    double captured = (out.chunks ? out.bytes : 0) + (err.chunks ? err.bytes : 0);
+    if(maxbytes > 0 && !capped && captured > maxbytes){
+      if(cgroup_kill(&cg) < 0)
+        warn_if(kill(pid, SIGKILL), "kill child");
+      killcount = 2;
+      capped = 1;
+    }
+    now = timestamp();
+    elapsed = now - start;
+    stream_tick(&out, now);
+    stream_tick(&err, now);
   }
-  warn_if(close(pipe_out[r]), "close stdout");
-  warn_if(close(pipe_err[r]), "close stderr");
+
+  double finished = timestamp();
+
+  //drain whatever the child left in the pipes
+  print_output(&out);
+  print_output(&err);
+  stream_finish(&out);
+  stream_finish(&err);
+  phases[2] = out.first;
+  phases[3] = finished;
+  phases[4] = timestamp();
+  if(pidfd >= 0)
+    close(pidfd);
+  close_if(pipe_in[w]);
+  close_if(pipe_out[r]);
+  close_if(pipe_err[r]);
+  close_if(zipfd[0]);
+  close_if(zipfd[1]);
+  SEXP cgstats = PROTECT(cgroup_stats(&cg));
+  cgroup_remove(&cg);
+  double dropped[2] = {stream_dropped(&out), stream_dropped(&err)};
 
   // check for execvp() error *after* closing pipes and zombie
   resume_sigchild();
   check_child_success(failure[r], CHAR(STRING_ELT(command, 0)));
+  errno = wait_errno;
+  bail_if(wait_errno, "wait4()");
+  if(out.overflow || err.overflow)
+    Rf_errorcall(R_NilValue, "Output too large to capture in memory");
+  int zip_error = compress_error(&out) ? compress_error(&out) : compress_error(&err);
+  if(zip_error < 0)
+    Rf_errorcall(R_NilValue, "Failed to compress output");
+  errno = zip_error;
+  bail_if(zip_error, "write compressed output");
+  if(input_failed)
+    Rf_errorcall(R_NilValue, "Failed to read the input for '%s'", CHAR(STRING_ELT(command, 0)));
 
-  if(WIFEXITED(status)){
-    return ScalarInteger(WEXITSTATUS(status));
+  //killed for too much output: minus the signal, so the output can be returned
+  if(WIFEXITED(status) || capped){
+    SEXP res = PROTECT(ScalarInteger(WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status)));
+    if(IS_TRUE(get_option(options, "rusage")))
+      setAttrib(res, install("rusage"), make_rusage(&usage, finished - spawned));
+    if(trace)
+      setAttrib(res, install("trace"), make_trace(spawned, phases, &out, &err));
+    if(cgstats != R_NilValue)
+      setAttrib(res, install("cgroup"), cgstats);
+    if(VECTOR_ELT(captures, 3) != R_NilValue){
+      setAttrib(res, install("stdout"), memfd_value(VECTOR_ELT(captures, 3)));
+    } else if(out.chunks){
+      setAttrib(res, install("stdout"), stream_value(&out));
+    }
+    if(VECTOR_ELT(captures, 4) != R_NilValue){
+      setAttrib(res, install("stderr"), memfd_value(VECTOR_ELT(captures, 4)));
+    } else if(err.chunks){
+      setAttrib(res, install("stderr"), stream_value(&err));
+    }
+    if(out.zip || err.zip){
+      const char * names[] = {"stdout_bytes", "stdout_compressed", "stderr_bytes", "stderr_compressed", ""};
+      SEXP sizes = PROTECT(mkNamed(REALSXP, names));
+      REAL(sizes)[0] = out.zip ? out.bytes : NA_REAL;
+      REAL(sizes)[1] = out.zip ? compress_size(&out) : NA_REAL;
+      REAL(sizes)[2] = err.zip ? err.bytes : NA_REAL;
+      REAL(sizes)[3] = err.zip ? compress_size(&err) : NA_REAL;
+      setAttrib(res, install("compression"), sizes);
+      UNPROTECT(1);
+    }
+    if(out.limited || err.limited || capped){
+      const char * names[] = {"stdout", "stderr", "killed", ""};
+      SEXP truncated = PROTECT(mkNamed(REALSXP, names));
+      REAL(truncated)[0] = dropped[0];
+      REAL(truncated)[1] = dropped[1];
+      REAL(truncated)[2] = capped;
+      setAttrib(res, install("truncated"), truncated);
+      UNPROTECT(1);
+    }
+    UNPROTECT(3);
+    return res;
   } else {
     int signal = WTERMSIG(status);
     if(signal != 0){
-      if(killcount && elapsed > totaltime){
+      if(totaltime > 0 && killcount && elapsed > totaltime){
         Rf_errorcall(R_NilValue, "Program '%s' terminated (timeout reached: %.2fsec)",
                      CHAR(STRING_ELT(command, 0)), totaltime);
       } else {
@@ -302,15 +1055,31 @@ SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SE
   }
 }
 
-SEXP R_exec_status(SEXP rpid, SEXP wait){
+SEXP R_exec_status(SEXP rpid, SEXP wait, SEXP options){
   int wstat = NA_INTEGER;
   pid_t pid = asInteger(rpid);
+  struct rusage usage;
+  int res;
+  int pidfd = asLogical(wait) ? open_pidfd(pid) : -1;
   do {
-    int res = waitpid(pid, &wstat, WNOHANG);
-    bail_if(res < 0, "waitpid()");
+    res = wait4(pid, &wstat, WNOHANG, &usage);
+    if(res < 0)
+      close_if(pidfd);
+    bail_if(res < 0, "wait4()");
     if(res)
       break;
-    usleep(100*1000);
+    //the pidfd wakes us up as soon as the child exits
+    if(pidfd >= 0){
+      struct pollfd ufd = {pidfd, POLLIN, 0};
+      poll(&ufd, 1, waitms);
+    } else {
+      usleep(100*1000);
+    }
   } while (asLogical(wait) && !pending_interrupt());
-  return ScalarInteger(wstat);
+  close_if(pidfd);
+  SEXP out = PROTECT(ScalarInteger(wstat));
+  if(res && IS_TRUE(get_option(options, "rusage")))
+    setAttrib(out, install("rusage"), make_rusage(&usage, NA_REAL));
+  UNPROTECT(1);
+  return out;
 }
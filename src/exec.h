@@ -0,0 +1,171 @@
+/* Internal API shared by the unix implementations in the src directory */
+#include <Rinternals.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "child.h"
+
+#define waitms 200
+#define IS_STRING(x) (Rf_isString(x) && Rf_length(x))
+#define IS_TRUE(x) (Rf_isLogical(x) && Rf_length(x) && asLogical(x))
+#define IS_FALSE(x) (Rf_isLogical(x) && Rf_length(x) && !asLogical(x))
+#define IS_CAPTURE(x) (TYPEOF(x) == RAWSXP)
+#define IS_FEED(x) (TYPEOF(x) == RAWSXP || Rf_isFunction(x))
+
+/* A cgroup v2 sub-group for a command or pipeline, see exec_cgroup() in R */
+typedef struct {
+  int dir;          // the group, -1 if none
+  int procs;        // its cgroup.procs, for the child
+  int parent;
+  char name[64];
+} cgroup_t;
+
+typedef enum {FRAME_NONE, FRAME_DELIM, FRAME_RECORD} frame_type;
+
+/* Where the output of a child stream goes: an R callback function, or with
+ * native capture, a list of raw vectors of increasing size */
+typedef struct {
+  int fd;           // read end of the pipe
+  SEXP fun;
+  SEXP chunks;      // NULL if not capturing
+  int nchunks;
+  int overflow;     // ran out of chunks or memory, the child gets killed
+  R_xlen_t used;    // bytes used in the last chunk
+  R_xlen_t total;
+  int limited;      // only keep the head and tail, see capture_limits() in R
+  R_xlen_t head;
+  R_xlen_t tail;
+  SEXP ring;        // the last 'tail' bytes, or a scratch buffer if tail is 0
+  R_xlen_t after;   // bytes read after the head was full
+  frame_type framing;
+  int delim;
+  int crlf;         // strip \r before the delimiter
+  R_xlen_t record;  // size of fixed records
+  int batch;        // max records per callback
+  double latency;   // max seconds a complete record waits for delivery
+  SEXP store;       // protects buf and records
+  SEXP buf;         // bytes not yet delivered
+  R_xlen_t buflen;
+  SEXP records;     // complete lines waiting for delivery, grows up to batch
+  int nrecords;
+  double since;     // when the oldest waiting record was completed
+  double first;     // when the first byte was read
+  double reads;     // read() calls
+  double bytes;
+  double callbacks; // calls into R
+  double callback_time;
+  R_xlen_t max_read;
+  int pipe_size;    // capacity of the pipe, 0 if unknown
+  int max_pipe;     // grow the pipe up to this size when it runs full
+  double stalls;    // times the pipe was found full
+  void * zip;       // deflate state if the output gets compressed, see compress.c
+  int queued;       // reads take the data that io_uring has read, see uring.c
+  const char * data;
+  size_t datalen;
+} stream_t;
+
+/* Data for the stdin pipe of the child: a raw vector, or an R function which
+ * returns the next chunk and raw(0) at the end */
+typedef struct {
+  int fd;           // write end of the pipe
+  SEXP source;
+  SEXP chunk;       // raw vector that is currently being written
+  R_xlen_t pos;
+  SEXP protect;
+  int i;
+  int failed;       // the function raised an error, the child got EOF early
+} feed_t;
+
+/* A completion from uring.c. For a read, res is the number of bytes in data,
+ * and more is set while the multishot read stays armed. */
+typedef struct uring uring_t;
+typedef struct {
+  uint64_t user;
+  int res;
+  int more;
+  const char * data;
+} event_t;
+
+/* Cumulative counters for the session, see exec_stats() in R */
+typedef struct {
+  double commands;
+  double spawn_time;
+  double reads;
+  double bytes;
+  double callbacks;
+  double callback_time;
+  double stalls;
+} stats_t;
+
+extern stats_t session_stats;
+
+/* spawn.c */
+pid_t spawn_child(spawn_t * s, SEXP options);
+pid_t spawn_helper(spawn_t * s);
+SEXP get_option(SEXP options, const char * name);
+
+/* forkserver.c */
+pid_t forkserver_spawn(spawn_t * s, const char * helper);
+
+/* cgroup.c */
+void cgroup_create(cgroup_t * cg, SEXP options);
+int cgroup_kill(cgroup_t * cg);
+SEXP cgroup_stats(cgroup_t * cg);
+void cgroup_remove(cgroup_t * cg);
+
+/* compress.c */
+int compress_enabled(SEXP options);
+void * compress_new(void);
+void compress_init(stream_t * stream, void * zip, int fd);
+int compress_output(stream_t * stream);
+void compress_finish(stream_t * stream);
+double compress_size(stream_t * stream);
+int compress_error(stream_t * stream);
+
+/* uring.c */
+uring_t * uring_open(SEXP protect, int i);
+void uring_close(uring_t * ring);
+void uring_read(uring_t * ring, int fd, uint64_t user);
+void uring_poll(uring_t * ring, int fd, double timeout, uint64_t user);
+void uring_cancel(uring_t * ring, uint64_t user);
+void uring_wait(uring_t * ring, int ms);
+int uring_next(uring_t * ring, event_t * event);
+
+/* memfd.c */
+SEXP memfd_new(void);
+int memfd_child(SEXP ptr);
+SEXP memfd_value(SEXP ptr);
+SEXP memfd_file(int fd);
+
+/* exec.c */
+void bail_if(int err, const char * what);
+void warn_if(int err, const char * what);
+void block_sigchld(void);
+void resume_sigchild(void);
+int pending_interrupt(void);
+double timestamp(void);
+int open_pidfd(pid_t pid);
+int try_open_stdin(SEXP input);
+int open_stdin(SEXP input);
+int try_open_output(const char * file);
+int open_output(const char * file);
+void close_if(int fd);
+const char * open_pipes(spawn_t * spec, int * failure, int * pipe_out, int * pipe_err,
+                        int * pipe_in, SEXP input, int block);
+void set_nonblock(int fd);
+int child_errno(int fd);
+void stream_init(stream_t * stream, int fd, SEXP fun, SEXP protect, int i);
+void stream_config(stream_t * stream, SEXP options);
+ssize_t stream_read(stream_t * stream, void * buf, size_t len);
+void capture_append(stream_t * stream, const void * data, R_xlen_t len);
+int print_output(stream_t * stream);
+SEXP stream_value(stream_t * stream);
+double stream_dropped(stream_t * stream);
+double stream_deadline(stream_t * stream, double deadline);
+void stream_tick(stream_t * stream, double now);
+void stream_finish(stream_t * stream);
+void feed_init(feed_t * feed, int fd, SEXP source, SEXP protect, int i);
+int write_input(feed_t * feed);
+char ** prepare_argv(SEXP args);
+SEXP make_rusage(struct rusage * ru, double elapsed);
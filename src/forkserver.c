@@ -0,0 +1,188 @@
+/* Spawns children from a small helper program (see forkserver/main.c) on
+ * behalf of R. Requests are sent over a unix socket, with the descriptors for
+ * the child attached as SCM_RIGHTS. The helper uses clone(CLONE_PARENT), so
+ * children are still children of R and can be waited for as usual. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include "exec.h"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#define HAVE_FORKSERVER
+#endif
+
+#ifdef HAVE_FORKSERVER
+
+extern char ** environ;
+
+static int server_sock = -1;
+static pid_t server_pid = -1;
+static pid_t server_owner = -1;  // a forked R process must not use the helper
+
+static void stop_server(void){
+  close_if(server_sock);
+  if(server_owner == getpid())
+    waitpid(server_pid, NULL, 0);
+  server_sock = -1;
+  server_pid = -1;
+}
+
+/* The helper is started with the vfork engine and the socket as its stdin,
+ * so it never holds a copy of the memory of R */
+static int start_server(const char * helper){
+  int sv[2];
+  int failure[2];
+  if(!*helper){
+    errno = ENOENT;
+    return -1;
+  }
+  if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+  if(pipe(failure) < 0){
+    int err = errno;
+    close(sv[0]);
+    close(sv[1]);
+    errno = err;
+    return -1;
+  }
+  char * argv[] = {(char *) helper, NULL};
+  spawn_t spec = {helper, argv, {sv[1], -1, -1}, failure[1], sysconf(_SC_OPEN_MAX)};
+  spec.cgroup = -1;
+  pid_t pid = spawn_helper(&spec);
+  int err = pid < 0 ? errno : 0;
+  close(sv[1]);
+  close(failure[1]);
+  if(pid > 0 && (err = child_errno(failure[0])))
+    waitpid(pid, NULL, 0);
+  else if(pid < 0)
+    close(failure[0]);
+  if(err){
+    close(sv[0]);
+    errno = err;
+    return -1;
+  }
+  server_sock = sv[0];
+  server_pid = pid;
+  server_owner = getpid();
+  return 0;
+}
+
+/* Fails with ENOSYS if the request could not be sent, so the caller can
+ * fall back on spawning the child itself. */
+pid_t forkserver_spawn(spawn_t * s, const char * helper){
+  //the helper would make children of a forked R process children of its
+  //parent, and a helper of its own would outlive a short lived fork
+  if(server_owner >= 0 && server_owner != getpid()){
+    errno = ENOSYS;
+    return -1;
+  }
+  if(server_sock < 0 && start_server(helper) < 0){
+    errno = ENOSYS;
+    return -1;
+  }
+  request_t req = {0, 0, {0, 0, 0}, 0, s->maxfd, 0};
+  sigprocmask(SIG_BLOCK, NULL, &req.mask);
+  req.limits = s->limits;
+  req.len = strlen(s->file) + 1;
+  for(char ** arg = s->argv; *arg; arg++, req.argc++)
+    req.len += strlen(*arg) + 1;
+  for(char ** env = environ; env && *env; env++, req.envc++)
+    req.len += strlen(*env) + 1;
+  char * data = R_alloc(req.len, 1);
+  char * p = stpcpy(data, s->file) + 1;
+  for(char ** arg = s->argv; *arg; arg++)
+    p = stpcpy(p, *arg) + 1;
+  for(char ** env = environ; env && *env; env++)
+    p = stpcpy(p, *env) + 1;
+
+  //descriptors that are not redirected are inherited from R
+  int fds[NFDS];
+  int nfds = 0;
+  for(int i = 0; i < 3; i++){
+    int fd = s->fds[i] >= 0 ? s->fds[i] : i;
+    if((req.hasfd[i] = fcntl(fd, F_GETFD) >= 0))
+      fds[nfds++] = fd;
+  }
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if(cwd < 0){
+    errno = ENOSYS;
+    return -1;
+  }
+  fds[nfds++] = s->failure;
+  fds[nfds++] = cwd;
+  if((req.hascgroup = s->cgroup > 2))
+    fds[nfds++] = s->cgroup;
+
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  ssize_t n;
+  do {
+    n = sendmsg(server_sock, &msg, MSG_NOSIGNAL);
+  } while(n < 0 && errno == EINTR);
+  close(cwd);
+  if(n < 0 || (n < sizeof(req) && send_all(server_sock, (char *) &req + n, sizeof(req) - n) < 0)){
+    stop_server();
+    errno = ENOSYS;
+    return -1;
+  }
+
+  //the helper may already have started the child, so do not fall back anymore
+  reply_t reply;
+  if(send_all(server_sock, data, req.len) < 0 || recv_all(server_sock, &reply, sizeof(reply)) < 0){
+    stop_server();
+    errno = EPIPE;
+    return -1;
+  }
+  errno = reply.err;
+  return reply.pid;
+}
+
+#else
+
+pid_t forkserver_spawn(spawn_t * s, const char * helper){
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+SEXP R_forkserver_start(SEXP helper){
+#ifdef HAVE_FORKSERVER
+  if(server_sock >= 0 && server_owner == getpid())
+    return ScalarInteger(server_pid);
+  bail_if(start_server(CHAR(STRING_ELT(helper, 0))) < 0, "start fork server");
+  return ScalarInteger(server_pid);
+#else
+  Rf_error("The fork server is only supported on Linux");
+#endif
+}
+
+SEXP R_forkserver_stop(void){
+#ifdef HAVE_FORKSERVER
+  if(server_sock < 0 || server_owner != getpid())
+    return ScalarLogical(FALSE);
+  stop_server();
+  return ScalarLogical(TRUE);
+#else
+  return ScalarLogical(FALSE);
+#endif
+}
@@ -0,0 +1,134 @@
+/* The fork server helper program, see forkserver.c. It is started with the
+ * socket to R as stdin, and never runs any R code, so it has a small address
+ * space of its own and no locks that were held by other threads of R. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "../child.h"
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sched.h>
+
+extern char ** environ;
+
+typedef struct {
+  spawn_t spec;
+  char ** envp;
+  int cwd;
+} job_t;
+
+/* Runs in the grandchild, which has its own copy of the helper memory */
+static int server_child(void * arg){
+  job_t * job = arg;
+  environ = job->envp;
+  if(fchdir(job->cwd) < 0){
+    int err = errno;
+    if(write(job->spec.failure, &err, sizeof(err)) < 0){}
+    return 127;
+  }
+  return child_exec(&job->spec);
+}
+
+static int server_request(int sock, char * stack, size_t stack_size){
+  request_t req;
+  int fds[NFDS];
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while(n < 0 && errno == EINTR);
+  if(n <= 0)
+    return -1;
+  if(n < sizeof(req) && recv_all(sock, (char *) &req + n, sizeof(req) - n) < 0)
+    return -1;
+  int nfds = 0;
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+  }
+  char * data = malloc(req.len);
+  char ** strings = malloc((req.argc + req.envc + 3) * sizeof(char *));
+  if(!data || !strings || recv_all(sock, data, req.len) < 0)
+    return -1;
+
+  //file, argv and environment are consecutive strings
+  char * p = data;
+  for(int i = 0; i < req.argc + req.envc + 1; i++){
+    strings[i + (i > req.argc)] = p;
+    p += strlen(p) + 1;
+  }
+  strings[req.argc + 1] = NULL;
+  strings[req.argc + req.envc + 2] = NULL;
+  job_t job = {{strings[0], strings + 1, {-1, -1, -1}, -1, req.maxfd, req.mask}, strings + req.argc + 2, -1};
+  job.spec.limits = req.limits;
+  int k = 0;
+  for(int i = 0; i < 3; i++){
+    if(req.hasfd[i] && k < nfds)
+      job.spec.fds[i] = fds[k++];
+  }
+  reply_t reply = {-1, EBADF};
+  if(nfds == k + 2 + req.hascgroup){
+    job.spec.failure = fds[k];
+    job.cwd = fds[k + 1];
+    job.spec.cgroup = req.hascgroup ? fds[k + 2] : -1;
+    reply.pid = clone(server_child, stack + stack_size, CLONE_PARENT | SIGCHLD, &job);
+    reply.err = errno;
+  }
+  for(int i = 0; i < nfds; i++)
+    close(fds[i]);
+  free(data);
+  free(strings);
+  return send_all(sock, &reply, sizeof(reply));
+}
+
+/* Exits when the socket gets closed by R */
+int main(int argc, char ** argv){
+  //not in the process group of R, so CTRL+C in the terminal does not hit us
+  setpgid(0, 0);
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+
+  //do not hold on to the terminal or pipes of R
+  int sock = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+  int null = open("/dev/null", O_RDWR);
+  if(sock < 0 || null < 0)
+    return 1;
+  for(int i = 0; i < 3; i++)
+    dup2(null, i);
+  if(null > 2)
+    close(null);
+
+  size_t stack_size = 512 * 1024;
+  char * stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if(stack == MAP_FAILED)
+    return 1;
+  while(server_request(sock, stack, stack_size) == 0);
+  return 0;
+}
+
+#else
+
+int main(int argc, char ** argv){
+  return 1;
+}
+
+#endif
@@ -4,16 +4,54 @@
 #include <R_ext/Rdynload.h>
 
 /* .Call calls */
-extern SEXP C_execute(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-extern SEXP R_exec_status(SEXP, SEXP);
+extern SEXP R_as_text(SEXP, SEXP, SEXP);
+extern SEXP R_cache_key(SEXP, SEXP);
+extern SEXP R_cache_lookup(SEXP, SEXP);
+extern SEXP R_cache_store(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_execute(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_exec_status(SEXP, SEXP, SEXP);
+extern SEXP R_exec_stats(SEXP);
+extern SEXP R_forkserver_start(SEXP);
+extern SEXP R_forkserver_stop(void);
+extern SEXP R_exec_parallel(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_exec_pipeline(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_exec_process(SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_process_fds(SEXP);
+extern SEXP R_process_kill(SEXP, SEXP);
+extern SEXP R_process_poll(SEXP, SEXP);
+extern SEXP R_process_read(SEXP);
+extern SEXP R_process_send(SEXP, SEXP, SEXP);
+extern SEXP R_process_wait(SEXP, SEXP);
+extern SEXP R_process_write(SEXP, SEXP, SEXP);
+
+/* ALTREP classes */
+extern void memfd_init(DllInfo *);
 
 static const R_CallMethodDef CallEntries[] = {
-    {"C_execute",     (DL_FUNC) &C_execute,     7},
-    {"R_exec_status", (DL_FUNC) &R_exec_status, 2},
+    {"R_as_text",     (DL_FUNC) &R_as_text,     3},
+    {"R_cache_key",   (DL_FUNC) &R_cache_key,   2},
+    {"R_cache_lookup", (DL_FUNC) &R_cache_lookup, 2},
+    {"R_cache_store", (DL_FUNC) &R_cache_store, 6},
+    {"C_execute",     (DL_FUNC) &C_execute,     8},
+    {"R_exec_status", (DL_FUNC) &R_exec_status, 3},
+    {"R_exec_stats",  (DL_FUNC) &R_exec_stats,  1},
+    {"R_forkserver_start", (DL_FUNC) &R_forkserver_start, 1},
+    {"R_forkserver_stop", (DL_FUNC) &R_forkserver_stop, 0},
+    {"R_exec_parallel", (DL_FUNC) &R_exec_parallel, 8},
+    {"R_exec_pipeline", (DL_FUNC) &R_exec_pipeline, 7},
+    {"R_exec_process", (DL_FUNC) &R_exec_process, 4},
+    {"R_process_fds", (DL_FUNC) &R_process_fds, 1},
+    {"R_process_kill", (DL_FUNC) &R_process_kill, 2},
+    {"R_process_poll", (DL_FUNC) &R_process_poll, 2},
+    {"R_process_read", (DL_FUNC) &R_process_read, 1},
+    {"R_process_send", (DL_FUNC) &R_process_send, 3},
+    {"R_process_wait", (DL_FUNC) &R_process_wait, 2},
+    {"R_process_write", (DL_FUNC) &R_process_write, 3},
     {NULL, NULL, 0}
 };
 
 void R_init_sys(DllInfo *dll){
+    memfd_init(dll);
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
 }
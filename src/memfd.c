@@ -0,0 +1,212 @@
+/* Output that the child writes to an anonymous file (memfd_create on Linux)
+ * instead of a pipe. Afterwards the file is exposed to R as an ALTREP raw
+ * vector which gets mapped into memory on first access, so the output is never
+ * copied. The file is closed when the vector is garbage collected. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+#include "exec.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 6, 0)
+#include <R_ext/Altrep.h>
+#define HAVE_ALTRAW
+#endif
+
+typedef struct {
+  int fd;
+  R_xlen_t size;    // fixed when the vector gets created
+  void * map;       // NULL until the data is needed
+} memfd_t;
+
+static memfd_t * get_memfd(SEXP ptr){
+  memfd_t * mem = R_ExternalPtrAddr(ptr);
+  if(!mem)
+    Rf_error("Captured output is no longer available");
+  return mem;
+}
+
+static void fin_memfd(SEXP ptr){
+  memfd_t * mem = R_ExternalPtrAddr(ptr);
+  if(!mem)
+    return;
+  if(mem->map)
+    munmap(mem->map, mem->size);
+  close_if(mem->fd);
+  free(mem);
+  R_ClearExternalPtr(ptr);
+}
+
+/* A file that only lives in memory, or an unlinked file in TMPDIR on systems
+ * without memfd_create() */
+static int create_memfd(void){
+#if defined(SYS_memfd_create) && defined(MFD_ALLOW_SEALING)
+  int fd = syscall(SYS_memfd_create, "sys-output", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd >= 0)
+    return fd;
+#endif
+  const char * tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char * path = R_alloc(strlen(tmpdir) + 20, 1);
+  strcpy(path, tmpdir);
+  strcat(path, "/sys-output-XXXXXX");
+  int tmp = mkstemp(path);
+  bail_if(tmp < 0, "mkstemp() for output");
+  unlink(path);
+  fcntl(tmp, F_SETFD, FD_CLOEXEC);
+  return tmp;
+}
+
+static SEXP memfd_handle(int fd){
+  memfd_t * mem = calloc(1, sizeof(memfd_t));
+  if(!mem){
+    close_if(fd);
+    Rf_error("Failed to allocate handle for captured output");
+  }
+  mem->fd = fd;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(mem, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, fin_memfd, TRUE);
+  UNPROTECT(1);
+  return ptr;
+}
+
+/* Returns a handle that owns the file, which is closed on error as well */
+SEXP memfd_new(void){
+  SEXP ptr = PROTECT(memfd_handle(-1));
+  get_memfd(ptr)->fd = create_memfd();
+  UNPROTECT(1);
+  return ptr;
+}
+
+/* A new descriptor for the child, which shares the file offset. Returns -1
+ * (with errno set) on failure. */
+int memfd_child(SEXP ptr){
+  return fcntl(get_memfd(ptr)->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static R_xlen_t memfd_read(memfd_t * mem, R_xlen_t i, R_xlen_t n, Rbyte * buf){
+  if(i >= mem->size)
+    return 0;
+  if(n > mem->size - i)
+    n = mem->size - i;
+  if(mem->map){
+    memcpy(buf, (char *) mem->map + i, n);
+    return n;
+  }
+  R_xlen_t done = 0;
+  while(done < n){
+    ssize_t len = pread(mem->fd, buf + done, n - done, i + done);
+    if(len < 0 && errno == EINTR)
+      continue;
+    bail_if(len < 0, "pread() captured output");
+    if(len == 0)
+      break;
+    done += len;
+  }
+  return done;
+}
+
+#ifdef HAVE_ALTRAW
+
+static R_altrep_class_t memfd_class;
+
+static void * memfd_map(memfd_t * mem){
+  if(!mem->map){
+    //private, so that R can modify the vector without touching the file
+    void * map = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, mem->fd, 0);
+    bail_if(map == MAP_FAILED, "mmap() captured output");
+    mem->map = map;
+  }
+  return mem->map;
+}
+
+static R_xlen_t memfd_Length(SEXP x){
+  return get_memfd(R_altrep_data1(x))->size;
+}
+
+static void * memfd_Dataptr(SEXP x, Rboolean writeable){
+  return memfd_map(get_memfd(R_altrep_data1(x)));
+}
+
+static const void * memfd_Dataptr_or_null(SEXP x){
+  return get_memfd(R_altrep_data1(x))->map;
+}
+
+static Rbyte memfd_Elt(SEXP x, R_xlen_t i){
+  Rbyte out = 0;
+  memfd_read(get_memfd(R_altrep_data1(x)), i, 1, &out);
+  return out;
+}
+
+static R_xlen_t memfd_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, Rbyte * buf){
+  return memfd_read(get_memfd(R_altrep_data1(x)), i, n, buf);
+}
+
+static Rboolean memfd_Inspect(SEXP x, int pre, int deep, int pvec,
+                              void (*inspect_subtree)(SEXP, int, int, int)){
+  memfd_t * mem = get_memfd(R_altrep_data1(x));
+  Rprintf(" sys memfd (fd %d, %.0f bytes, %s)\n", mem->fd, (double) mem->size,
+          mem->map ? "mapped" : "not mapped");
+  return TRUE;
+}
+
+void memfd_init(DllInfo * dll){
+  memfd_class = R_make_altraw_class("memfd", "sys", dll);
+  R_set_altrep_Length_method(memfd_class, memfd_Length);
+  R_set_altrep_Inspect_method(memfd_class, memfd_Inspect);
+  R_set_altvec_Dataptr_method(memfd_class, memfd_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(memfd_class, memfd_Dataptr_or_null);
+  R_set_altraw_Elt_method(memfd_class, memfd_Elt);
+  R_set_altraw_Get_region_method(memfd_class, memfd_Get_region);
+}
+
+#else
+
+void memfd_init(DllInfo * dll){}
+
+#endif
+
+/* A raw vector for a regular file that is never modified in place, such as
+ * an entry in the result cache. Takes over the descriptor. */
+SEXP memfd_file(int fd){
+  SEXP ptr = PROTECT(memfd_handle(fd));
+  SEXP out = memfd_value(ptr);
+  UNPROTECT(1);
+  return out;
+}
+
+/* The output as a raw vector, which takes over the file. Without ALTREP the
+ * data is read into a regular vector instead. */
+SEXP memfd_value(SEXP ptr){
+  memfd_t * mem = get_memfd(ptr);
+  struct stat info;
+  bail_if(fstat(mem->fd, &info) < 0, "fstat() captured output");
+  mem->size = info.st_size;
+  if(mem->size == 0)
+    return allocVector(RAWSXP, 0);
+#ifdef F_ADD_SEALS
+  //a shrinking file would crash R on access to the mapped pages
+  fcntl(mem->fd, F_ADD_SEALS, F_SEAL_SHRINK);
+#endif
+#ifdef HAVE_ALTRAW
+  return R_new_altrep(memfd_class, ptr, R_NilValue);
+#else
+  SEXP out = PROTECT(allocVector(RAWSXP, mem->size));
+  memfd_read(mem, 0, mem->size, RAW(out));
+  fin_memfd(ptr);
+  UNPROTECT(1);
+  return out;
+#endif
+}
@@ -0,0 +1,277 @@
+/* Runs cmd1 | cmd2 | ... with the stages connected by pipes */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include "exec.h"
+
+#define r 0
+#define w 1
+
+typedef struct {
+  pid_t pid;
+  int pidfd;      // -1 if not supported
+  int status;
+  int reaped;
+} stage_t;
+
+static void kill_stages(stage_t * stages, int n, int signal){
+  for(int i = 0; i < n; i++){
+    if(stages[i].pid > 0 && !stages[i].reaped)
+      warn_if(kill(stages[i].pid, signal), "kill child");
+  }
+}
+
+/* Kills and reaps the stages that were started when a later one fails */
+static void abort_stages(stage_t * stages, int n){
+  kill_stages(stages, n, SIGKILL);
+  for(int i = 0; i < n; i++){
+    if(stages[i].pid > 0 && !stages[i].reaped)
+      waitpid(stages[i].pid, NULL, 0);
+    close_if(stages[i].pidfd);
+  }
+}
+
+SEXP R_exec_pipeline(SEXP commands, SEXP argvs, SEXP outfun, SEXP errfun, SEXP input,
+                     SEXP timeout, SEXP options){
+  int n = Rf_length(commands);
+  stage_t * stages = (stage_t *) R_alloc(n, sizeof(stage_t));
+  memset(stages, 0, n * sizeof(stage_t));
+  int pipe_out[2] = {-1, -1};
+  int pipe_err[2] = {-1, -1};
+  int pipe_in[2] = {-1, -1};
+
+  //all stages share one cgroup, which is created before anything is opened
+  cgroup_t cg;
+  cgroup_create(&cg, options);
+
+  //the last stage writes to a file or pipe, all stages share stderr
+  int outfd = -1;
+  int errfd = -1;
+  int prev = -1;
+  const char * failed = NULL;
+  if(IS_STRING(outfun) && (outfd = try_open_output(CHAR(STRING_ELT(outfun, 0)))) < 0){
+    failed = "open() output file";
+  } else if(IS_STRING(errfun) && (errfd = try_open_output(CHAR(STRING_ELT(errfun, 0)))) < 0){
+    failed = "open() output file";
+  } else if(outfd < 0 && pipe(pipe_out) < 0){
+    failed = "create pipe";
+  } else if(errfd < 0 && pipe(pipe_err) < 0){
+    failed = "create pipe";
+  } else if((prev = try_open_stdin(input)) == -2){
+    failed = "open() input file";
+  } else if(IS_FEED(input) && pipe(pipe_in) < 0){
+    failed = "create pipe";
+  }
+  if(failed){
+    int err = errno;
+    close_if(outfd);
+    close_if(errfd);
+    close_if(prev);
+    close_if(pipe_out[r]);
+    close_if(pipe_out[w]);
+    close_if(pipe_err[r]);
+    close_if(pipe_err[w]);
+    cgroup_remove(&cg);
+    errno = err;
+    bail_if(1, failed);
+  }
+  if(outfd < 0)
+    outfd = pipe_out[w];
+  if(errfd < 0)
+    errfd = pipe_err[w];
+  if(IS_FEED(input))
+    prev = pipe_in[r];
+
+  block_sigchld();
+  for(int i = 0; i < n; i++){
+    int link[2] = {-1, -1};
+    int failure[2] = {-1, -1};
+    const char * cmd = CHAR(STRING_ELT(commands, i));
+    spawn_t spec = {cmd, prepare_argv(VECTOR_ELT(argvs, i)), {prev, -1, errfd}, -1, sysconf(_SC_OPEN_MAX)};
+
+    //a stage that could not be started stops the pipeline, as a failed execvp()
+    int err = 0;
+    if((i < n - 1 && pipe(link) < 0) || pipe(failure) < 0)
+      err = errno;
+    spec.fds[STDOUT_FILENO] = i < n - 1 ? link[w] : outfd;
+    spec.failure = failure[w];
+    spec.cgroup = cg.procs;
+    if(!err && (stages[i].pid = spawn_child(&spec, options)) < 0)
+      err = errno;
+    close_if(failure[w]);
+    close_if(prev);
+    close_if(link[w]);
+    prev = link[r];
+    if(stages[i].pid > 0){
+      err = child_errno(failure[r]);
+    } else {
+      close_if(failure[r]);
+    }
+    if(err){
+      if(stages[i].pid > 0){
+        waitpid(stages[i].pid, NULL, 0);
+        stages[i].reaped = 1;
+      }
+      abort_stages(stages, i);
+      cgroup_remove(&cg);
+      close_if(prev);
+      close_if(outfd);
+      close_if(errfd);
+      close_if(pipe_out[r]);
+      close_if(pipe_err[r]);
+      close_if(pipe_in[w]);
+      resume_sigchild();
+      Rf_errorcall(R_NilValue, "Failed to execute '%s' (%s)", cmd, strerror(err));
+    }
+    stages[i].pidfd = open_pidfd(stages[i].pid);
+  }
+  close_if(cg.procs);
+  cg.procs = -1;
+  close_if(outfd);
+  close_if(errfd);
+
+  //output goes to R callbacks or gets captured natively
+  SEXP captures = PROTECT(allocVector(VECSXP, 3));
+  stream_t out, err;
+  stream_init(&out, pipe_out[r], outfun, captures, 0);
+  stream_init(&err, pipe_err[r], errfun, captures, 1);
+  stream_config(&out, options);
+  stream_config(&err, options);
+  if(pipe_out[r] >= 0)
+    set_nonblock(pipe_out[r]);
+  if(pipe_err[r] >= 0)
+    set_nonblock(pipe_err[r]);
+  feed_t in;
+  if(pipe_in[w] >= 0){
+    set_nonblock(pipe_in[w]);
+    feed_init(&in, pipe_in[w], input, captures, 2);
+  }
+
+  struct pollfd * ufds = (struct pollfd *) R_alloc(n + 3, sizeof(struct pollfd));
+  double totaltime = REAL(timeout)[0];
+  double start = timestamp();
+  double now = start;
+  double next_check = start;
+  int backoff = 1;
+  int killcount = 0;
+  int interrupted = 0;
+  int input_failed = 0;
+  int running = n;
+  ufds[0] = (struct pollfd) {pipe_out[r], POLLIN, 0};
+  ufds[1] = (struct pollfd) {pipe_err[r], POLLIN, 0};
+  ufds[2] = (struct pollfd) {pipe_in[w], POLLOUT, 0};
+  while(running){
+    //the whole chain shares one timeout
+    if(totaltime > 0){
+      if(killcount == 0 && now - start > totaltime && cgroup_kill(&cg) == 0){
+        killcount = 2;
+      } else if(killcount == 0 && now - start > totaltime){
+        kill_stages(stages, n, SIGINT);
+        killcount++;
+      } else if(killcount == 1 && now - start > totaltime + 1){
+        kill_stages(stages, n, SIGKILL);
+        killcount++;
+      }
+    }
+    if(now >= next_check){
+      next_check = now + waitms / 1000.0;
+      if(pending_interrupt()){
+        if(!killcount || cgroup_kill(&cg) < 0)
+          kill_stages(stages, n, killcount ? SIGKILL : SIGINT);
+        killcount++;
+        interrupted = 1;
+      }
+    }
+
+    //sleep until there is output, a stage exits, or the next deadline
+    double deadline = next_check;
+    if(totaltime > 0 && killcount < 2 && start + totaltime + killcount < deadline)
+      deadline = start + totaltime + killcount;
+    deadline = stream_deadline(&out, stream_deadline(&err, deadline));
+    int ms = deadline > now ? (deadline - now) * 1000 + 1 : 0;
+    int have_pidfd = 1;
+    for(int i = 0; i < n; i++){
+      ufds[3 + i] = (struct pollfd) {stages[i].reaped ? -1 : stages[i].pidfd, POLLIN, 0};
+      if(stages[i].pidfd < 0)
+        have_pidfd = 0;
+    }
+    if(!have_pidfd && ms > backoff){
+      ms = backoff;
+      backoff = backoff * 2 > waitms ? waitms : backoff * 2;
+    }
+    if(poll(ufds, n + 3, ms) > 0)
+      backoff = 1;
+
+    if(ufds[2].fd >= 0 && ufds[2].revents && !write_input(&in)){
+      input_failed = in.failed;
+      close(pipe_in[w]);
+      ufds[2].fd = pipe_in[w] = -1;
+    }
+    if(ufds[0].fd >= 0 && !print_output(&out))
+      ufds[0].fd = -1;
+    if(ufds[1].fd >= 0 && !print_output(&err))
+      ufds[1].fd = -1;
+    if((out.overflow || err.overflow) && killcount < 2){
+      if(cgroup_kill(&cg) < 0)
+        kill_stages(stages, n, SIGKILL);
+      killcount = 2;
+    }
+
+    //reap stages that have exited
+    for(int i = 0; i < n; i++){
+      if(stages[i].reaped || (have_pidfd && !ufds[3 + i].revents))
+        continue;
+      if(waitpid(stages[i].pid, &stages[i].status, WNOHANG) != 0){
+        stages[i].reaped = 1;
+        running--;
+      }
+    }
+    now = timestamp();
+    stream_tick(&out, now);
+    stream_tick(&err, now);
+  }
+
+  print_output(&out);
+  print_output(&err);
+  stream_finish(&out);
+  stream_finish(&err);
+  for(int i = 0; i < n; i++)
+    close_if(stages[i].pidfd);
+  close_if(pipe_in[w]);
+  close_if(pipe_out[r]);
+  close_if(pipe_err[r]);
+  SEXP cgstats = PROTECT(cgroup_stats(&cg));
+  cgroup_remove(&cg);
+  resume_sigchild();
+
+  if(interrupted)
+    Rf_errorcall(R_NilValue, "Pipeline terminated by SIGNAL (Interrupt)");
+  if(out.overflow || err.overflow)
+    Rf_errorcall(R_NilValue, "Output too large to capture in memory");
+  if(input_failed)
+    Rf_errorcall(R_NilValue, "Failed to read the input for the pipeline");
+  if(totaltime > 0 && killcount && now - start > totaltime)
+    Rf_errorcall(R_NilValue, "Pipeline terminated (timeout reached: %.2fsec)", totaltime);
+
+  //exit code of each stage, or minus the signal number
+  SEXP res = PROTECT(allocVector(INTSXP, n));
+  for(int i = 0; i < n; i++){
+    int status = stages[i].status;
+    INTEGER(res)[i] = WIFEXITED(status) ? WEXITSTATUS(status) :
+      WIFSIGNALED(status) ? -WTERMSIG(status) : NA_INTEGER;
+  }
+  if(out.chunks)
+    setAttrib(res, install("stdout"), stream_value(&out));
+  if(err.chunks)
+    setAttrib(res, install("stderr"), stream_value(&err));
+  if(cgstats != R_NilValue)
+    setAttrib(res, install("cgroup"), cgstats);
+  UNPROTECT(3);
+  return res;
+}
@@ -0,0 +1,530 @@
+/* Runs many commands concurrently from a single poll() or io_uring loop */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include "exec.h"
+
+#define r 0
+#define w 1
+
+typedef enum {JOB_PENDING, JOB_RUNNING, JOB_DONE} job_state;
+
+typedef struct {
+  job_state state;
+  pid_t pid;
+  int pidfd;      // -1 if not supported
+  stream_t out;   // fd is -1 after EOF
+  stream_t err;
+  int failure;    // read end of execvp errno pipe
+  int status;
+  int exited;     // pidfd signalled that the child is gone
+  int reaped;
+  int wait_errno;   // waitpid() failed, so the status is unknown
+  int reading;    // armed io_uring reads: 1 for stdout, 2 for stderr
+  int starved;    // reads that ran out of buffers, re-armed after the drain
+  int killcount;
+  double start;
+  double timeout;
+} job_t;
+
+/* State of the event loop, shared by the poll() and io_uring versions */
+typedef struct {
+  job_t * jobs;
+  int n;
+  int max;
+  int next;         // next job to start
+  int first;        // first job that is not done
+  int running;
+  int interrupted;
+  double next_check;
+  uring_t * ring;   // NULL for the poll() loop
+  SEXP commands, argvs, outfuns, errfuns, inputs, options, errors, captures;
+} batch_t;
+
+/* Which job and stream a pollfd belongs to */
+typedef struct {
+  int job;
+  int stream;     // 1 = stdout, 2 = stderr, 0 = pidfd
+} owner_t;
+
+static SEXP list_elt(SEXP x, int i){
+  return Rf_length(x) ? VECTOR_ELT(x, i % Rf_length(x)) : R_NilValue;
+}
+
+static void set_error(SEXP errors, int i, const char * fmt, const char * cmd, const char * what){
+  char buf[1000];
+  snprintf(buf, sizeof(buf), fmt, cmd, what);
+  SET_STRING_ELT(errors, i, mkChar(buf));
+}
+
+static void close_pipe(int fds[2]){
+  close_if(fds[r]);
+  close_if(fds[w]);
+}
+
+/* Returns 0 if the job could not be started. Failures only affect this job,
+ * so they are reported in 'errors' instead of raising an R error. */
+static int start_job(job_t * job, int i, SEXP commands, SEXP argvs, SEXP outfuns, SEXP errfuns,
+                     SEXP inputs, SEXP options, SEXP errors, SEXP captures){
+  const char * cmd = CHAR(STRING_ELT(commands, i));
+  int pipe_out[2] = {-1, -1};
+  int pipe_err[2] = {-1, -1};
+  int failure[2] = {-1, -1};
+  spawn_t spec = {cmd, prepare_argv(list_elt(argvs, i)), {-1, -1, -1}, -1, sysconf(_SC_OPEN_MAX)};
+  if(pipe(failure) || pipe(pipe_out) || pipe(pipe_err) ||
+     fcntl(pipe_out[r], F_SETFL, O_NONBLOCK) < 0 || fcntl(pipe_err[r], F_SETFL, O_NONBLOCK) < 0){
+    set_error(errors, i, "Failed to execute '%s' (%s)", cmd, strerror(errno));
+    close_pipe(failure);
+    close_pipe(pipe_out);
+    close_pipe(pipe_err);
+    return 0;
+  }
+  spec.fds[STDIN_FILENO] = try_open_stdin(list_elt(inputs, i));
+  if(spec.fds[STDIN_FILENO] == -2){
+    set_error(errors, i, "Failed to open input file for '%s' (%s)", cmd, strerror(errno));
+    close_pipe(failure);
+    close_pipe(pipe_out);
+    close_pipe(pipe_err);
+    return 0;
+  }
+  spec.fds[STDOUT_FILENO] = pipe_out[w];
+  spec.fds[STDERR_FILENO] = pipe_err[w];
+  spec.failure = failure[w];
+  job->pid = spawn_child(&spec, options);
+  int spawn_errno = errno;
+  close_if(spec.fds[STDIN_FILENO]);
+  close(pipe_out[w]);
+  close(pipe_err[w]);
+  close(failure[w]);
+  if(job->pid < 0){
+    set_error(errors, i, "Failed to execute '%s' (%s)", cmd, strerror(spawn_errno));
+    close(pipe_out[r]);
+    close(pipe_err[r]);
+    close(failure[r]);
+    return 0;
+  }
+
+  //from here on the job gets killed and reaped if R raises an error
+  job->out.fd = pipe_out[r];
+  job->err.fd = pipe_err[r];
+  job->failure = failure[r];
+  job->pidfd = -1;
+  job->state = JOB_RUNNING;
+  stream_init(&job->out, pipe_out[r], list_elt(outfuns, i), captures, 2 * i);
+  stream_init(&job->err, pipe_err[r], list_elt(errfuns, i), captures, 2 * i + 1);
+  stream_config(&job->out, options);
+  stream_config(&job->err, options);
+  job->pidfd = open_pidfd(job->pid);
+  job->start = timestamp();
+  return 1;
+}
+
+static void finish_job(job_t * job, int i, SEXP commands, SEXP errors){
+  const char * cmd = CHAR(STRING_ELT(commands, i));
+  if(job->out.fd >= 0)
+    print_output(&job->out);
+  if(job->err.fd >= 0)
+    print_output(&job->err);
+  stream_finish(&job->out);
+  stream_finish(&job->err);
+  close_if(job->out.fd);
+  close_if(job->err.fd);
+  close_if(job->pidfd);
+  job->state = JOB_DONE;
+  int err = child_errno(job->failure);
+  if(err){
+    set_error(errors, i, "Failed to execute '%s' (%s)", cmd, strerror(err));
+  } else if(job->wait_errno){
+    set_error(errors, i, "Failed to wait for '%s' (%s)", cmd, strerror(job->wait_errno));
+  } else if(job->out.overflow || job->err.overflow){
+    set_error(errors, i, "Program '%s' terminated (%s)", cmd, "output too large to capture in memory");
+  } else if(!WIFEXITED(job->status)){
+    int signal = WIFSIGNALED(job->status) ? WTERMSIG(job->status) : 0;
+    if(job->timeout > 0 && job->killcount && timestamp() - job->start > job->timeout){
+      char what[100];
+      snprintf(what, sizeof(what), "timeout reached: %.2fsec", job->timeout);
+      set_error(errors, i, "Program '%s' terminated (%s)", cmd, what);
+    } else {
+      set_error(errors, i, "Program '%s' terminated by SIGNAL (%s)", cmd, strsignal(signal));
+    }
+  }
+}
+
+/* A job whose output no longer fits in memory gets killed */
+static void check_overflow(job_t * job){
+  if((job->out.overflow || job->err.overflow) && job->killcount < 2){
+    warn_if(kill(job->pid, SIGKILL), "kill child");
+    job->killcount = 2;
+  }
+}
+
+/* Starts jobs until max_jobs are running */
+static void top_up(batch_t * b){
+  while(!b->interrupted && b->running < b->max && b->next < b->n){
+    int i = b->next++;
+    if(start_job(&b->jobs[i], i, b->commands, b->argvs, b->outfuns, b->errfuns,
+                 b->inputs, b->options, b->errors, b->captures)){
+      b->running++;
+    } else {
+      b->jobs[i].state = JOB_DONE;
+    }
+  }
+}
+
+/* Forwards interrupts to all children and cancels pending jobs */
+static void check_interrupt(batch_t * b, double now){
+  if(now < b->next_check)
+    return;
+  b->next_check = now + waitms / 1000.0;
+  if(pending_interrupt()){
+    for(int i = b->first; i < b->next; i++){
+      if(b->jobs[i].state == JOB_RUNNING){
+        warn_if(kill(b->jobs[i].pid, b->interrupted ? SIGKILL : SIGINT), "kill child");
+        b->jobs[i].killcount++;
+      }
+    }
+    b->interrupted++;
+    b->next = b->n;
+  }
+}
+
+static void skip_done(batch_t * b){
+  while(b->first < b->n && (b->jobs[b->first].state == JOB_DONE ||
+        (b->interrupted && b->jobs[b->first].state == JOB_PENDING)))
+    b->first++;
+}
+
+static void poll_loop(batch_t * b){
+  job_t * jobs = b->jobs;
+  struct pollfd * ufds = (struct pollfd *) R_alloc(3 * b->max, sizeof(struct pollfd));
+  owner_t * owners = (owner_t *) R_alloc(3 * b->max, sizeof(owner_t));
+  int backoff = 1;
+  while(b->first < b->n){
+    top_up(b);
+    double now = timestamp();
+    check_interrupt(b, now);
+
+    //per job timeouts and collect descriptors to poll
+    double deadline = b->next_check;
+    int nfds = 0;
+    int have_pidfd = 1;
+    for(int i = b->first; i < b->next; i++){
+      job_t * job = &jobs[i];
+      if(job->state != JOB_RUNNING)
+        continue;
+      check_overflow(job);
+      if(job->timeout > 0){
+        double elapsed = now - job->start;
+        if(job->killcount == 0 && elapsed > job->timeout){
+          warn_if(kill(job->pid, SIGINT), "interrupt child");
+          job->killcount++;
+        } else if(job->killcount == 1 && elapsed > (job->timeout + 1)){
+          warn_if(kill(job->pid, SIGKILL), "force kill child");
+          job->killcount++;
+        }
+        if(job->killcount < 2 && job->start + job->timeout + job->killcount < deadline)
+          deadline = job->start + job->timeout + job->killcount;
+      }
+      stream_tick(&job->out, now);
+      stream_tick(&job->err, now);
+      deadline = stream_deadline(&job->out, stream_deadline(&job->err, deadline));
+      int fds[3] = {job->pidfd, job->out.fd, job->err.fd};
+      for(int k = 0; k < 3; k++){
+        if(fds[k] < 0)
+          continue;
+        ufds[nfds].fd = fds[k];
+        ufds[nfds].events = POLLIN;
+        ufds[nfds].revents = 0;
+        owners[nfds].job = i;
+        owners[nfds].stream = k;
+        nfds++;
+      }
+      if(job->pidfd < 0)
+        have_pidfd = 0;
+    }
+
+    //sleep until there is output, a child exits, or the next deadline
+    int ms = deadline > now ? (deadline - now) * 1000 + 1 : 0;
+    if(!have_pidfd && ms > backoff){
+      ms = backoff;
+      backoff = backoff * 2 > waitms ? waitms : backoff * 2;
+    }
+    if(poll(ufds, nfds, ms) > 0)
+      backoff = 1;
+
+    //print stdout/stderr buffers, stop polling pipes after EOF
+    for(int k = 0; k < nfds; k++){
+      if(!ufds[k].revents)
+        continue;
+      int i = owners[k].job;
+      if(owners[k].stream == 0){
+        jobs[i].exited = 1;
+        continue;
+      }
+      stream_t * stream = owners[k].stream == 1 ? &jobs[i].out : &jobs[i].err;
+      if(!print_output(stream)){
+        close(stream->fd);
+        stream->fd = -1;
+      }
+    }
+
+    //reap children that have exited
+    for(int i = b->first; i < b->next; i++){
+      job_t * job = &jobs[i];
+      if(job->state != JOB_RUNNING || (have_pidfd && !job->exited))
+        continue;
+      pid_t res = waitpid(job->pid, &job->status, WNOHANG);
+      if(res < 0)
+        job->wait_errno = errno;
+      if(res != 0){
+        job->reaped = 1;
+        finish_job(job, i, b->commands, b->errors);
+        b->running--;
+      }
+    }
+    skip_done(b);
+  }
+}
+
+/* Completions carry the job index and what they are about */
+#define EV_EXIT 0
+#define EV_STDOUT 1
+#define EV_STDERR 2
+#define EVENT(i, kind) ((uint64_t) (i) << 2 | (kind))
+
+/* Seconds until the next signal for a job with a timeout, or 0 */
+static double time_left(job_t * job, double now){
+  if(job->timeout <= 0 || job->killcount >= 2)
+    return 0;
+  double left = job->start + job->timeout + job->killcount - now;
+  return left > 0.001 ? left : 0.001;
+}
+
+static void arm_job(uring_t * ring, job_t * job, int i){
+  job->out.queued = job->err.queued = 1;
+  uring_read(ring, job->out.fd, EVENT(i, EV_STDOUT));
+  uring_read(ring, job->err.fd, EVENT(i, EV_STDERR));
+  job->reading = 3;
+  if(job->pidfd >= 0)
+    uring_poll(ring, job->pidfd, time_left(job, timestamp()), EVENT(i, EV_EXIT));
+}
+
+/* The child is gone, reads that are still armed (for example because a
+ * grandchild holds the pipe) get cancelled. Leftovers are read at the end. */
+static void reap_job(uring_t * ring, job_t * job, int i){
+  pid_t res = waitpid(job->pid, &job->status, WNOHANG);
+  if(res == 0)
+    return;
+  if(res < 0)
+    job->wait_errno = errno;
+  job->reaped = 1;
+  for(int k = EV_STDOUT; k <= EV_STDERR; k++){
+    if(job->reading & k)
+      uring_cancel(ring, EVENT(i, k));
+  }
+}
+
+static void uring_event(batch_t * b, uring_t * ring, event_t * ev){
+  int i = ev->user >> 2;
+  int kind = ev->user & 3;
+  job_t * job = &b->jobs[i];
+  if(kind == EV_EXIT){
+    if(ev->res == -ECANCELED){
+      //the linked timeout expired
+      warn_if(kill(job->pid, job->killcount ? SIGKILL : SIGINT), "kill child");
+      job->killcount++;
+      uring_poll(ring, job->pidfd, time_left(job, timestamp()), EVENT(i, EV_EXIT));
+    } else if(ev->res < 0){
+      //wait for this one with waitpid() from the loop
+      close(job->pidfd);
+      job->pidfd = -1;
+    } else {
+      job->exited = 1;
+      reap_job(ring, job, i);
+      if(!job->reaped)
+        uring_poll(ring, job->pidfd, time_left(job, timestamp()), EVENT(i, EV_EXIT));
+    }
+    return;
+  }
+  stream_t * stream = kind == EV_STDOUT ? &job->out : &job->err;
+  if(ev->res > 0){
+    stream->data = ev->data;
+    stream->datalen = ev->res;
+    print_output(stream);
+  }
+  if(ev->more)
+    return;
+  if(!job->reaped && ev->res == -ENOBUFS){
+    job->starved |= kind;
+    return;
+  }
+  if(!job->reaped && ev->res > 0){
+    uring_read(ring, stream->fd, ev->user);
+    return;
+  }
+  job->reading &= ~kind;
+  if(ev->res == 0 || (ev->res < 0 && ev->res != -ECANCELED && ev->res != -ENOBUFS)){
+    close(stream->fd);
+    stream->fd = -1;
+  }
+}
+
+static void uring_loop(batch_t * b, uring_t * ring){
+  job_t * jobs = b->jobs;
+  int backoff = 1;
+  while(b->first < b->n){
+    int started = b->next;
+    top_up(b);
+    for(int i = started; i < b->next; i++){
+      if(jobs[i].state == JOB_RUNNING)
+        arm_job(ring, &jobs[i], i);
+    }
+    double now = timestamp();
+    check_interrupt(b, now);
+
+    //timeouts are linked to the exit polls, records may need to be delivered
+    double deadline = b->next_check;
+    int have_pidfd = 1;
+    for(int i = b->first; i < b->next; i++){
+      job_t * job = &jobs[i];
+      if(job->state != JOB_RUNNING)
+        continue;
+      check_overflow(job);
+      stream_tick(&job->out, now);
+      stream_tick(&job->err, now);
+      deadline = stream_deadline(&job->out, stream_deadline(&job->err, deadline));
+      if(job->pidfd < 0)
+        have_pidfd = 0;
+    }
+    int ms = deadline > now ? (deadline - now) * 1000 + 1 : 0;
+    if(!have_pidfd && ms > backoff){
+      ms = backoff;
+      backoff = backoff * 2 > waitms ? waitms : backoff * 2;
+    }
+    uring_wait(ring, ms);
+    event_t ev;
+    while(uring_next(ring, &ev))
+      uring_event(b, ring, &ev);
+
+    //reads that ran out of buffers, children without a pidfd, and jobs whose
+    //reads have ended
+    for(int i = b->first; i < b->next; i++){
+      job_t * job = &jobs[i];
+      if(job->state != JOB_RUNNING)
+        continue;
+      for(int k = EV_STDOUT; k <= EV_STDERR; k++){
+        if(job->starved & k && job->reaped){
+          job->reading &= ~k;
+        } else if(job->starved & k){
+          uring_read(ring, k == EV_STDOUT ? job->out.fd : job->err.fd, EVENT(i, k));
+        }
+      }
+      job->starved = 0;
+      if(!job->reaped && job->pidfd < 0){
+        if(job->timeout > 0 && job->killcount < 2 && now > job->start + job->timeout + job->killcount){
+          warn_if(kill(job->pid, job->killcount ? SIGKILL : SIGINT), "kill child");
+          job->killcount++;
+        }
+        reap_job(ring, job, i);
+      }
+      if(job->reaped && !job->reading){
+        job->out.queued = job->err.queued = 0;
+        finish_job(job, i, b->commands, b->errors);
+        b->running--;
+      }
+    }
+    skip_done(b);
+  }
+}
+
+static SEXP run_batch(void * data){
+  batch_t * b = data;
+  if(b->ring){
+    uring_loop(b, b->ring);
+  } else {
+    poll_loop(b);
+  }
+  return R_NilValue;
+}
+
+/* Also runs when the loop raises an R error (for example when R runs out of
+ * memory): then the children that are still running get killed and reaped
+ * before the error propagates. */
+static void end_batch(void * data, Rboolean jump){
+  batch_t * b = data;
+  if(b->ring)
+    uring_close(b->ring);
+  for(int i = b->first; jump && i < b->next; i++){
+    job_t * job = &b->jobs[i];
+    if(job->state != JOB_RUNNING)
+      continue;
+    if(!job->reaped){
+      kill(job->pid, SIGKILL);
+      waitpid(job->pid, &job->status, 0);
+    }
+    close_if(job->out.fd);
+    close_if(job->err.fd);
+    close_if(job->pidfd);
+    close_if(job->failure);
+    job->state = JOB_DONE;
+  }
+  resume_sigchild();
+}
+
+SEXP R_exec_parallel(SEXP commands, SEXP argvs, SEXP outfuns, SEXP errfuns, SEXP inputs,
+                     SEXP timeouts, SEXP max_jobs, SEXP options){
+  int n = Rf_length(commands);
+  int max = asInteger(max_jobs);
+  if(max == NA_INTEGER || max < 1)
+    Rf_error("Parameter 'max_jobs' must be a positive number");
+  job_t * jobs = (job_t *) R_alloc(n, sizeof(job_t));
+  SEXP errors = PROTECT(allocVector(STRSXP, n));
+  SEXP captures = PROTECT(allocVector(VECSXP, 2 * n + 1));
+  for(int i = 0; i < n; i++){
+    memset(&jobs[i], 0, sizeof(job_t));
+    jobs[i].timeout = REAL(timeouts)[i % Rf_length(timeouts)];
+    SET_STRING_ELT(errors, i, NA_STRING);
+  }
+  batch_t batch = {jobs, n, max, 0, 0, 0, 0, timestamp(), NULL,
+                   commands, argvs, outfuns, errfuns, inputs, options, errors, captures};
+
+  //the last slot of captures holds the ring, which falls back to poll()
+  SEXP loop = get_option(options, "loop");
+  if(IS_STRING(loop) && !strcmp(CHAR(STRING_ELT(loop, 0)), "uring"))
+    batch.ring = uring_open(captures, 2 * n);
+  SEXP cont = PROTECT(R_MakeUnwindCont());
+  block_sigchld();
+  R_UnwindProtect(run_batch, &batch, end_batch, &batch, cont);
+  if(batch.interrupted)
+    Rf_errorcall(R_NilValue, "Parallel execution interrupted");
+
+  SEXP status = PROTECT(allocVector(INTSXP, n));
+  SEXP stdouts = PROTECT(allocVector(VECSXP, n));
+  SEXP stderrs = PROTECT(allocVector(VECSXP, n));
+  for(int i = 0; i < n; i++){
+    int ok = jobs[i].state == JOB_DONE && STRING_ELT(errors, i) == NA_STRING && WIFEXITED(jobs[i].status);
+    INTEGER(status)[i] = ok ? WEXITSTATUS(jobs[i].status) : NA_INTEGER;
+    SET_VECTOR_ELT(stdouts, i, jobs[i].out.chunks ? stream_value(&jobs[i].out) : allocVector(RAWSXP, 0));
+    SET_VECTOR_ELT(stderrs, i, jobs[i].err.chunks ? stream_value(&jobs[i].err) : allocVector(RAWSXP, 0));
+  }
+  SEXP out = PROTECT(allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(out, 0, status);
+  SET_VECTOR_ELT(out, 1, errors);
+  SET_VECTOR_ELT(out, 2, stdouts);
+  SET_VECTOR_ELT(out, 3, stderrs);
+  SEXP names = PROTECT(allocVector(STRSXP, 4));
+  SET_STRING_ELT(names, 0, mkChar("status"));
+  SET_STRING_ELT(names, 1, mkChar("error"));
+  SET_STRING_ELT(names, 2, mkChar("stdout"));
+  SET_STRING_ELT(names, 3, mkChar("stderr"));
+  setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(8);
+  return out;
+}
@@ -0,0 +1,326 @@
+/* Background processes with a handle that holds a pidfd and the output pipes */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include "exec.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define r 0
+#define w 1
+
+typedef struct {
+  pid_t pid;
+  int pidfd;        // -1 if not supported
+  int exited;
+  int status;
+  int in;           // write end of the stdin pipe, -1 if none
+  stream_t out;     // fd is -1 after EOF
+  stream_t err;
+} process_t;
+
+static process_t * get_process(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP || !R_ExternalPtrAddr(ptr))
+    Rf_error("Invalid or closed process handle");
+  return R_ExternalPtrAddr(ptr);
+}
+
+/* Does not block. Returns 1 if the child has been reaped. */
+static int process_reap(process_t * proc){
+  if(!proc->exited && waitpid(proc->pid, &proc->status, WNOHANG) == proc->pid)
+    proc->exited = 1;
+  return proc->exited;
+}
+
+/* Read whatever is available into the buffers of the handle. Nothing is
+ * blocked here, so running out of room can raise the error right away. */
+static void process_drain(process_t * proc){
+  if(proc->out.fd >= 0 && !print_output(&proc->out)){
+    close(proc->out.fd);
+    proc->out.fd = -1;
+  }
+  if(proc->err.fd >= 0 && !print_output(&proc->err)){
+    close(proc->err.fd);
+    proc->err.fd = -1;
+  }
+  if(proc->out.overflow || proc->err.overflow){
+    proc->out.overflow = proc->err.overflow = 0;
+    Rf_errorcall(R_NilValue, "Output too large to capture in memory");
+  }
+}
+
+/* The process keeps running when the handle gets garbage collected, but it
+ * is reaped if it already exited so it does not stay around as a zombie. */
+static void fin_process(SEXP ptr){
+  process_t * proc = R_ExternalPtrAddr(ptr);
+  if(!proc)
+    return;
+  process_reap(proc);
+  close_if(proc->in);
+  close_if(proc->out.fd);
+  close_if(proc->err.fd);
+  close_if(proc->pidfd);
+  free(proc);
+  R_ClearExternalPtr(ptr);
+}
+
+/* Exit code, or minus the signal number if the child was killed */
+static int process_code(process_t * proc){
+  if(WIFEXITED(proc->status))
+    return WEXITSTATUS(proc->status);
+  return WIFSIGNALED(proc->status) ? -WTERMSIG(proc->status) : NA_INTEGER;
+}
+
+SEXP R_exec_process(SEXP command, SEXP args, SEXP input, SEXP options){
+  int pipe_out[2] = {-1, -1};
+  int pipe_err[2] = {-1, -1};
+  int pipe_in[2] = {-1, -1};
+  int failure[2] = {-1, -1};
+  spawn_t spec = {CHAR(STRING_ELT(command, 0)), prepare_argv(args), {-1, -1, -1}, -1, sysconf(_SC_OPEN_MAX)};
+
+  //allocated before any descriptor is opened, so running out of memory can
+  //not leak them. The finalizer only frees the handle until the child runs.
+  process_t * proc = calloc(1, sizeof(process_t));
+  if(!proc)
+    Rf_error("Failed to allocate process handle");
+  proc->exited = 1;
+  proc->pidfd = proc->in = proc->out.fd = proc->err.fd = -1;
+  SEXP store = PROTECT(allocVector(VECSXP, 3));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(proc, R_NilValue, store));
+  R_RegisterCFinalizerEx(ptr, fin_process, TRUE);
+
+  //slot 2 holds the raw() that selects native capture for both streams
+  SET_VECTOR_ELT(store, 2, allocVector(RAWSXP, 0));
+
+  //open stdin and the pipes, a raw vector gives the child a stdin pipe (see
+  //process_write). The error is raised after closing the ones that worked.
+  const char * failed = NULL;
+  if((spec.fds[STDIN_FILENO] = try_open_stdin(input)) == -2)
+    failed = "open() input file";
+  if(!failed)
+    failed = open_pipes(&spec, failure, pipe_out, pipe_err, pipe_in, input, 1);
+  pid_t pid = -1;
+  if(!failed && (pid = spawn_child(&spec, options)) < 0)
+    failed = "fork()";
+  int spawn_errno = errno;
+  close_if(spec.fds[STDIN_FILENO]);
+  close_if(spec.fds[STDOUT_FILENO]);
+  close_if(spec.fds[STDERR_FILENO]);
+  close_if(failure[w]);
+  if(failed){
+    close_if(pipe_in[w]);
+    close_if(pipe_out[r]);
+    close_if(pipe_err[r]);
+    close_if(failure[r]);
+    errno = spawn_errno;
+    bail_if(1, failed);
+  }
+  int err = child_errno(failure[r]);
+  if(err){
+    close_if(pipe_in[w]);
+    close(pipe_out[r]);
+    close(pipe_err[r]);
+    waitpid(pid, NULL, 0);
+    Rf_errorcall(R_NilValue, "Failed to execute '%s' (%s)", CHAR(STRING_ELT(command, 0)), strerror(err));
+  }
+  set_nonblock(pipe_out[r]);
+  set_nonblock(pipe_err[r]);
+  if(pipe_in[w] >= 0)
+    set_nonblock(pipe_in[w]);
+  proc->pid = pid;
+  proc->exited = 0;
+  proc->pidfd = open_pidfd(pid);
+  proc->in = pipe_in[w];
+  stream_init(&proc->out, pipe_out[r], VECTOR_ELT(store, 2), store, 0);
+  stream_init(&proc->err, pipe_err[r], VECTOR_ELT(store, 2), store, 1);
+  stream_config(&proc->out, options);
+  stream_config(&proc->err, options);
+  setAttrib(ptr, install("pid"), ScalarInteger(pid));
+  setAttrib(ptr, R_ClassSymbol, mkString("sys_process"));
+  UNPROTECT(2);
+  return ptr;
+}
+
+SEXP R_process_read(SEXP ptr){
+  process_t * proc = get_process(ptr);
+  process_drain(proc);
+  SEXP out = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(out, 0, stream_value(&proc->out));
+  SET_VECTOR_ELT(out, 1, stream_value(&proc->err));
+  SEXP names = PROTECT(allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, mkChar("stdout"));
+  SET_STRING_ELT(names, 1, mkChar("stderr"));
+  setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return out;
+}
+
+/* Writes all data to the stdin of the child, meanwhile buffering its output so
+ * the child can not block on a full pipe either. Returns FALSE if the child
+ * stopped reading. */
+SEXP R_process_write(SEXP ptr, SEXP data, SEXP close_input){
+  process_t * proc = get_process(ptr);
+  if(proc->in < 0)
+    Rf_error("The stdin of this process is not a pipe, or it was closed");
+  SEXP protect = PROTECT(allocVector(VECSXP, 1));
+  feed_t feed;
+  feed_init(&feed, proc->in, data, protect, 0);
+  while(write_input(&feed)){
+    struct pollfd ufds[3] = {
+      {proc->in, POLLOUT, 0},
+      {proc->out.fd, POLLIN, 0},
+      {proc->err.fd, POLLIN, 0}
+    };
+    poll(ufds, 3, waitms);
+    process_drain(proc);
+    if(pending_interrupt())
+      Rf_errorcall(R_NilValue, "Interrupted while writing to process");
+  }
+  int done = feed.pos == XLENGTH(data);
+  if(!done || asLogical(close_input)){
+    close(proc->in);
+    proc->in = -1;
+  }
+  UNPROTECT(1);
+  return ScalarLogical(done);
+}
+
+/* Writes the data from 'offset' that fits in the stdin pipe without blocking,
+ * for writing from another event loop. Returns the new offset, or -1 if the
+ * child stopped reading. */
+SEXP R_process_send(SEXP ptr, SEXP data, SEXP offset){
+  process_t * proc = get_process(ptr);
+  if(proc->in < 0)
+    Rf_error("The stdin of this process is not a pipe, or it was closed");
+  SEXP protect = PROTECT(allocVector(VECSXP, 1));
+  feed_t feed;
+  feed_init(&feed, proc->in, data, protect, 0);
+  feed.pos = asReal(offset);
+  int open = write_input(&feed);
+  UNPROTECT(1);
+  return ScalarReal(open || feed.pos == XLENGTH(data) ? feed.pos : -1);
+}
+
+/* Descriptors to watch from another event loop: the pidfd, stdout, stderr and
+ * stdin, NA for those that are closed or not supported */
+SEXP R_process_fds(SEXP ptr){
+  process_t * proc = get_process(ptr);
+  int fds[4] = {proc->pidfd, proc->out.fd, proc->err.fd, proc->in};
+  SEXP out = allocVector(INTSXP, 4);
+  for(int i = 0; i < 4; i++)
+    INTEGER(out)[i] = fds[i] < 0 ? NA_INTEGER : fds[i];
+  return out;
+}
+
+/* Polls the handles until one has output or has exited. A negative timeout
+ * waits forever. Returns a logical vector with the handles that are ready. */
+SEXP R_process_poll(SEXP handles, SEXP timeout){
+  int n = Rf_length(handles);
+  double limit = asReal(timeout);
+  double deadline = timestamp() + limit;
+  struct pollfd * ufds = (struct pollfd *) R_alloc(3 * n + 1, sizeof(struct pollfd));
+  int * owners = (int *) R_alloc(3 * n + 1, sizeof(int));
+  SEXP ready = PROTECT(allocVector(LGLSXP, n));
+  int backoff = 1;
+  while(1){
+    //output that was drained by process_wait() but not yet read is also ready
+    int found = 0;
+    int nfds = 0;
+    int have_pidfd = 1;
+    for(int i = 0; i < n; i++){
+      process_t * proc = get_process(VECTOR_ELT(handles, i));
+      LOGICAL(ready)[i] = process_reap(proc) || proc->out.total || proc->err.total;
+      found += LOGICAL(ready)[i];
+      int fds[3] = {proc->pidfd, proc->out.fd, proc->err.fd};
+      for(int k = 0; k < 3; k++){
+        if(fds[k] < 0)
+          continue;
+        ufds[nfds].fd = fds[k];
+        ufds[nfds].events = POLLIN;
+        ufds[nfds].revents = 0;
+        owners[nfds++] = i;
+      }
+      if(proc->pidfd < 0)
+        have_pidfd = 0;
+    }
+    double now = timestamp();
+    if(found || (limit >= 0 && now >= deadline))
+      break;
+    int ms = waitms;
+    if(limit >= 0 && (deadline - now) * 1000 + 1 < ms)
+      ms = (deadline - now) * 1000 + 1;
+    if(!have_pidfd && ms > backoff){
+      ms = backoff;
+      backoff = backoff * 2 > waitms ? waitms : backoff * 2;
+    }
+    if(poll(ufds, nfds, ms) > 0){
+      for(int k = 0; k < nfds; k++){
+        if(ufds[k].revents)
+          LOGICAL(ready)[owners[k]] = found = 1;
+      }
+      if(found)
+        break;
+    }
+    if(pending_interrupt())
+      Rf_errorcall(R_NilValue, "Interrupted while polling processes");
+  }
+  UNPROTECT(1);
+  return ready;
+}
+
+/* Waits for the child to exit while buffering its output, so it does not
+ * block on a full pipe. Returns NA if the timeout was reached. */
+SEXP R_process_wait(SEXP ptr, SEXP timeout){
+  process_t * proc = get_process(ptr);
+  double limit = asReal(timeout);
+  double deadline = timestamp() + limit;
+  int backoff = 1;
+  while(!process_reap(proc)){
+    double now = timestamp();
+    if(limit >= 0 && now >= deadline)
+      return ScalarInteger(NA_INTEGER);
+    struct pollfd ufds[3] = {
+      {proc->pidfd, POLLIN, 0},
+      {proc->out.fd, POLLIN, 0},
+      {proc->err.fd, POLLIN, 0}
+    };
+    int ms = waitms;
+    if(limit >= 0 && (deadline - now) * 1000 + 1 < ms)
+      ms = (deadline - now) * 1000 + 1;
+    if(proc->pidfd < 0 && ms > backoff){
+      ms = backoff;
+      backoff = backoff * 2 > waitms ? waitms : backoff * 2;
+    }
+    if(poll(ufds, 3, ms) > 0)
+      backoff = 1;
+    process_drain(proc);
+    if(pending_interrupt())
+      Rf_errorcall(R_NilValue, "Interrupted while waiting for process");
+  }
+  process_drain(proc);
+  return ScalarInteger(process_code(proc));
+}
+
+/* A pidfd can not signal a different process that reused the pid */
+SEXP R_process_kill(SEXP ptr, SEXP signal){
+  process_t * proc = get_process(ptr);
+  if(process_reap(proc))
+    return ScalarLogical(FALSE);
+#ifdef SYS_pidfd_send_signal
+  if(proc->pidfd >= 0){
+    bail_if(syscall(SYS_pidfd_send_signal, proc->pidfd, asInteger(signal), NULL, 0) < 0, "pidfd_send_signal()");
+    return ScalarLogical(TRUE);
+  }
+#endif
+  bail_if(kill(proc->pid, asInteger(signal)) < 0, "kill()");
+  return ScalarLogical(TRUE);
+}
@@ -0,0 +1,132 @@
+/* For clone() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include "exec.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sched.h>
+#define HAVE_VFORK_SPAWN
+#endif
+
+SEXP get_option(SEXP options, const char * name){
+  SEXP names = getAttrib(options, R_NamesSymbol);
+  for(int i = 0; i < Rf_length(names); i++){
+    if(!strcmp(CHAR(STRING_ELT(names, i)), name))
+      return VECTOR_ELT(options, i);
+  }
+  return R_NilValue;
+}
+
+/* Order of the limits in limits_t */
+static const char * rlimit_names[NLIMITS] = {"as", "cpu_time", "nofile"};
+
+/* Validated in R by exec_limits(), here we only copy the values */
+static void limits_init(limits_t * limits, SEXP options){
+  memset(limits, 0, sizeof(limits_t));
+  SEXP list = get_option(options, "limits");
+  if(!Rf_length(list))
+    return;
+  //exec_limits() checks the values and the platform, this must not raise an
+  //error because the caller has pipes open and SIGCHLD blocked
+  SEXP cpus = get_option(list, "cpus");
+  if(Rf_length(cpus)){
+    limits->has_cpus = 1;
+    for(int i = 0; i < Rf_length(cpus); i++){
+      int cpu = INTEGER(cpus)[i];
+      if(cpu >= 0 && cpu < MAX_CPUS)
+        limits->cpus[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+    }
+  }
+  SEXP nice = get_option(list, "nice");
+  if(Rf_length(nice)){
+    limits->has_nice = 1;
+    limits->nice = asInteger(nice);
+  }
+  SEXP ioprio = get_option(list, "ioprio");
+  if(Rf_length(ioprio))
+    limits->ioprio = asInteger(ioprio);
+  for(int i = 0; i < NLIMITS; i++){
+    SEXP value = get_option(list, rlimit_names[i]);
+    if(Rf_length(value)){
+      limits->has_rlimit[i] = 1;
+      limits->rlimit[i] = R_FINITE(asReal(value)) ? (rlim_t) asReal(value) : RLIM_INFINITY;
+    }
+  }
+}
+
+/* The vfork engine uses clone(CLONE_VM | CLONE_VFORK) like posix_spawn() does,
+ * so we never copy the page tables of a (possibly huge) R process. The parent
+ * is suspended until the child has called execvp() or failed. */
+#ifdef HAVE_VFORK_SPAWN
+static pid_t spawn_vfork(spawn_t * s){
+  //execvp() may copy argv onto the stack when running a script
+  size_t stack_size = 512 * 1024;
+  for(char ** arg = s->argv; *arg; arg++)
+    stack_size += sizeof(char *);
+  char * stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if(stack == MAP_FAILED)
+    return -1;
+  sigset_t all;
+  sigfillset(&all);
+  sigprocmask(SIG_BLOCK, &all, &s->mask);
+  pid_t pid = clone(child_exec, stack + stack_size, CLONE_VM | CLONE_VFORK | SIGCHLD, s);
+  int err = errno;
+  sigprocmask(SIG_SETMASK, &s->mask, NULL);
+  munmap(stack, stack_size);
+  errno = err;
+  return pid;
+}
+#endif
+
+static pid_t spawn_fork(spawn_t * s){
+  sigprocmask(SIG_BLOCK, NULL, &s->mask);
+  pid_t pid = fork();
+  if(pid == 0){
+    child_exec(s);
+    //exit() not allowed by CRAN. raise() should suffice
+    raise(SIGKILL);
+  }
+  return pid;
+}
+
+static pid_t spawn_engine(spawn_t * s, SEXP options){
+  SEXP engine = get_option(options, "spawn");
+  if(IS_STRING(engine) && !strcmp(CHAR(STRING_ELT(engine, 0)), "server")){
+    SEXP helper = get_option(options, "helper");
+    pid_t pid = forkserver_spawn(s, IS_STRING(helper) ? CHAR(STRING_ELT(helper, 0)) : "");
+    if(pid > 0 || errno != ENOSYS)
+      return pid;
+  }
+#ifdef HAVE_VFORK_SPAWN
+  if(!IS_STRING(engine) || strcmp(CHAR(STRING_ELT(engine, 0)), "fork")){
+    pid_t pid = spawn_vfork(s);
+    if(pid > 0 || (errno != ENOSYS && errno != EPERM && errno != ENOMEM))
+      return pid;
+  }
+#endif
+  return spawn_fork(s);
+}
+
+pid_t spawn_child(spawn_t * s, SEXP options){
+  limits_init(&s->limits, options);
+  double start = timestamp();
+  pid_t pid = spawn_engine(s, options);
+  session_stats.spawn_time += timestamp() - start;
+  session_stats.commands += pid > 0;
+  return pid;
+}
+
+/* Starts a program of the package itself, such as the fork server helper,
+ * which does not count as a command */
+pid_t spawn_helper(spawn_t * s){
+  memset(&s->limits, 0, sizeof(limits_t));
+  return spawn_engine(s, R_NilValue);
+}
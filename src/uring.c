@@ -0,0 +1,313 @@
+/* Optional io_uring event loop for exec_parallel(), see options(sys.loop). The
+ * output pipes get a multishot read that takes buffers from a ring which is
+ * registered with the kernel, so output arrives without a poll() and read()
+ * for every chunk. Exits are a poll of the pidfd, with a linked timeout for
+ * the deadline of the job. The ring is only opened if the kernel supports all
+ * of this (Linux 6.7), otherwise exec_parallel() uses its poll() loop. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include "exec.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#define HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Newer than the oldest headers with IORING_FEAT_EXT_ARG (Linux 5.11) */
+#define OP_READ_MULTISHOT 49
+#define REGISTER_PBUF_RING 22
+
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define NBUFS 1024
+#define BUFSIZE 16384
+#define INTERNAL UINT64_MAX
+
+/* Entry of the provided buffer ring. The tail of the ring overlays the last
+ * field of the first entry. */
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t bid;
+  uint16_t tail;
+} pbuf_t;
+
+typedef struct {
+  uint64_t ring_addr;
+  uint32_t ring_entries;
+  uint16_t bgid;
+  uint16_t pad;
+  uint64_t resv[3];
+} pbuf_reg_t;
+
+struct uring {
+  int fd;
+  SEXP ptr;
+  char * rings;         // sq and cq share one mapping
+  size_t rings_size;
+  struct io_uring_sqe * sqes;
+  size_t sqes_size;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned tail;        // local sq tail, published by uring_wait()
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe * cqes;
+  struct __kernel_timespec * timeouts;  // for linked timeouts, per sqe
+  pbuf_t * bufring;
+  char * bufs;
+  uint16_t buftail;
+  int recycle;          // buffer of the previous event, -1 if none
+};
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void * arg, size_t size){
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static void fin_uring(SEXP ptr){
+  uring_t * ring = R_ExternalPtrAddr(ptr);
+  if(!ring)
+    return;
+  if(ring->rings)
+    munmap(ring->rings, ring->rings_size);
+  if(ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if(ring->bufring)
+    munmap(ring->bufring, NBUFS * sizeof(pbuf_t));
+  if(ring->bufs)
+    munmap(ring->bufs, (size_t) NBUFS * BUFSIZE);
+  close(ring->fd);
+  free(ring->timeouts);
+  free(ring);
+  R_ClearExternalPtr(ptr);
+}
+
+static int supports_multishot(int fd){
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe * probe = (struct io_uring_probe *) R_alloc(1, size);
+  memset(probe, 0, size);
+  if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    return 0;
+  return probe->last_op >= OP_READ_MULTISHOT && (probe->ops[OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+}
+
+static int map_rings(uring_t * ring, struct io_uring_params * p){
+  size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  void * rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if(rings == MAP_FAILED)
+    return -1;
+  ring->rings = rings;
+  ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+  void * sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED)
+    return -1;
+  ring->sqes = sqes;
+  ring->sq_head = (unsigned *) (ring->rings + p->sq_off.head);
+  ring->sq_tail = (unsigned *) (ring->rings + p->sq_off.tail);
+  ring->sq_array = (unsigned *) (ring->rings + p->sq_off.array);
+  ring->sq_mask = *(unsigned *) (ring->rings + p->sq_off.ring_mask);
+  ring->sq_entries = p->sq_entries;
+  ring->tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *) (ring->rings + p->cq_off.head);
+  ring->cq_tail = (unsigned *) (ring->rings + p->cq_off.tail);
+  ring->cq_mask = *(unsigned *) (ring->rings + p->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (ring->rings + p->cq_off.cqes);
+  ring->timeouts = calloc(p->sq_entries, sizeof(struct __kernel_timespec));
+  return ring->timeouts ? 0 : -1;
+}
+
+static void provide_buffer(uring_t * ring, int bid){
+  pbuf_t * buf = &ring->bufring[ring->buftail & (NBUFS - 1)];
+  buf->addr = (uint64_t) (uintptr_t) (ring->bufs + (size_t) bid * BUFSIZE);
+  buf->len = BUFSIZE;
+  buf->bid = bid;
+  ring->buftail++;
+  __atomic_store_n(&ring->bufring[0].tail, ring->buftail, __ATOMIC_RELEASE);
+}
+
+static int add_buffers(uring_t * ring){
+  void * bufring = mmap(NULL, NBUFS * sizeof(pbuf_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(bufring == MAP_FAILED)
+    return -1;
+  ring->bufring = bufring;
+  void * bufs = mmap(NULL, (size_t) NBUFS * BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(bufs == MAP_FAILED)
+    return -1;
+  ring->bufs = bufs;
+  pbuf_reg_t reg = {(uint64_t) (uintptr_t) bufring, NBUFS, 0, 0, {0}};
+  if(syscall(__NR_io_uring_register, ring->fd, REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+  for(int i = 0; i < NBUFS; i++)
+    provide_buffer(ring, i);
+  return 0;
+}
+
+/* Returns NULL if io_uring is not available, for example because of an old
+ * kernel or a seccomp filter in a container. The handle is stored in slot i of
+ * 'protect', so the ring gets released by the GC after an error. */
+uring_t * uring_open(SEXP protect, int i){
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = CQ_ENTRIES;
+  int fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+  if(fd < 0)
+    return NULL;
+  uring_t * ring = calloc(1, sizeof(uring_t));
+  if(!ring){
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->recycle = -1;
+  ring->ptr = SET_VECTOR_ELT(protect, i, R_MakeExternalPtr(ring, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ring->ptr, fin_uring, TRUE);
+  if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+     !supports_multishot(fd) || map_rings(ring, &params) < 0 || add_buffers(ring) < 0){
+    fin_uring(ring->ptr);
+    return NULL;
+  }
+  return ring;
+}
+
+void uring_close(uring_t * ring){
+  fin_uring(ring->ptr);
+}
+
+/* Entries are submitted by uring_wait(), or here when the queue has no room
+ * for a pair of linked entries */
+static void make_room(uring_t * ring){
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if(ring->tail - head <= ring->sq_entries - 2)
+    return;
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+  bail_if(uring_enter(ring->fd, ring->tail - head, 0, 0, NULL, 0) < 0, "io_uring_enter()");
+  if(ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_entries - 2)
+    Rf_error("The io_uring submission queue is full");
+}
+
+static struct io_uring_sqe * get_sqe(uring_t * ring){
+  unsigned index = ring->tail++ & ring->sq_mask;
+  ring->sq_array[index] = index;
+  struct io_uring_sqe * sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = INTERNAL;
+  return sqe;
+}
+
+void uring_read(uring_t * ring, int fd, uint64_t user){
+  make_room(ring);
+  struct io_uring_sqe * sqe = get_sqe(ring);
+  sqe->opcode = OP_READ_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->fd = fd;
+  sqe->buf_group = 0;
+  sqe->user_data = user;
+}
+
+/* Completes with POLLIN, or -ECANCELED if the timeout came first */
+void uring_poll(uring_t * ring, int fd, double timeout, uint64_t user){
+  make_room(ring);
+  struct io_uring_sqe * sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  sqe->poll32_events = POLLIN << 16;
+#else
+  sqe->poll32_events = POLLIN;
+#endif
+  sqe->user_data = user;
+  if(timeout > 0){
+    sqe->flags = IOSQE_IO_LINK;
+    struct io_uring_sqe * link = get_sqe(ring);
+    struct __kernel_timespec * ts = &ring->timeouts[(ring->tail - 1) & ring->sq_mask];
+    ts->tv_sec = timeout;
+    ts->tv_nsec = (timeout - ts->tv_sec) * 1e9;
+    link->opcode = IORING_OP_LINK_TIMEOUT;
+    link->addr = (uint64_t) (uintptr_t) ts;
+    link->len = 1;
+  }
+}
+
+void uring_cancel(uring_t * ring, uint64_t user){
+  make_room(ring);
+  struct io_uring_sqe * sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user;
+}
+
+/* Submits the queued entries and waits up to ms for a completion */
+void uring_wait(uring_t * ring, int ms){
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+  int ready = *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  struct __kernel_timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  struct io_uring_getevents_arg arg = {0, 0, 0, (uint64_t) (uintptr_t) &ts};
+  int res = uring_enter(ring->fd, ring->tail - head, !ready, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  bail_if(res < 0 && errno != ETIME && errno != EINTR && errno != EBUSY, "io_uring_enter()");
+}
+
+/* Returns 0 if there are no more completions. The buffer of a read stays
+ * valid until the next call. */
+int uring_next(uring_t * ring, event_t * event){
+  if(ring->recycle >= 0){
+    provide_buffer(ring, ring->recycle);
+    ring->recycle = -1;
+  }
+  while(1){
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      return 0;
+    struct io_uring_cqe * cqe = &ring->cqes[head & ring->cq_mask];
+    event->user = cqe->user_data;
+    event->res = cqe->res;
+    event->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    event->data = NULL;
+    if(cqe->flags & IORING_CQE_F_BUFFER){
+      ring->recycle = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      event->data = ring->bufs + (size_t) ring->recycle * BUFSIZE;
+    }
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    if(event->user != INTERNAL)
+      return 1;
+  }
+}
+
+#else
+
+uring_t * uring_open(SEXP protect, int i){
+  return NULL;
+}
+
+void uring_close(uring_t * ring){}
+void uring_read(uring_t * ring, int fd, uint64_t user){}
+void uring_poll(uring_t * ring, int fd, double timeout, uint64_t user){}
+void uring_cancel(uring_t * ring, uint64_t user){}
+void uring_wait(uring_t * ring, int ms){}
+
+int uring_next(uring_t * ring, event_t * event){
+  return 0;
+}
+
+#endif
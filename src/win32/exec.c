@@ -1,6 +1,6 @@
 #include <Rinternals.h>
+#include <R_ext/Rdynload.h>
 #include <windows.h>
-#include <sys/time.h>
 
 /* NOTES
  * On Windows, when wait = FALSE and std_out = TRUE or std_err = TRUE
@@ -90,14 +90,39 @@ static wchar_t* sexp_to_wchar(SEXP args){
   return out;
 }
 
+/* Cumulative counters for the session, see exec_stats() in R */
+static double stats[6];
+
+static double timestamp(void){
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double) count.QuadPart / freq.QuadPart;
+}
+
+SEXP R_exec_stats(SEXP reset){
+  const char * names[] = {"commands", "spawn_time", "reads", "bytes_read", "callbacks",
+                          "callback_time", "pipe_stalls", ""};
+  SEXP out = PROTECT(mkNamed(REALSXP, names));
+  memcpy(REAL(out), stats, sizeof(stats));
+  REAL(out)[6] = NA_REAL;
+  if(asLogical(reset) == TRUE)
+    memset(stats, 0, sizeof(stats));
+  UNPROTECT(1);
+  return out;
+}
+
 static void R_callback(SEXP fun, const char * buf, ssize_t len){
   if(!isFunction(fun)) return;
   int ok;
+  double start = timestamp();
   SEXP str = PROTECT(allocVector(RAWSXP, len));
   memcpy(RAW(str), buf, len);
   SEXP call = PROTECT(LCONS(fun, LCONS(str, R_NilValue)));
   R_tryEval(call, R_GlobalEnv, &ok);
   UNPROTECT(2);
+  stats[4]++;
+  stats[5] += timestamp() - start;
 }
 
 //ReadFile blocks so no need to sleep()
@@ -134,8 +159,11 @@ static void ReadFromPipe(SEXP fun, HANDLE pipe){
       break;
     char buffer[len];
     unsigned long outlen;
-    if(ReadFile(pipe, buffer, len, &outlen, NULL))
+    stats[2]++;
+    if(ReadFile(pipe, buffer, len, &outlen, NULL)){
+      stats[3] += outlen;
       R_callback(fun, buffer, outlen);
+    }
   }
 }
 
@@ -168,6 +196,39 @@ static HANDLE fd_write(const char * path){
   return out;
 }
 
+static SEXP get_option(SEXP options, const char * name){
+  SEXP names = getAttrib(options, R_NamesSymbol);
+  for(int i = 0; i < Rf_length(names); i++){
+    if(!strcmp(CHAR(STRING_ELT(names, i)), name))
+      return VECTOR_ELT(options, i);
+  }
+  return R_NilValue;
+}
+
+static double filetime_seconds(FILETIME ft){
+  ULARGE_INTEGER x;
+  x.LowPart = ft.dwLowDateTime;
+  x.HighPart = ft.dwHighDateTime;
+  return x.QuadPart * 1e-7; //100 nanosecond units
+}
+
+/* Windows only has cpu times, other fields are NA */
+static SEXP make_rusage(HANDLE proc){
+  const char * names[] = {"elapsed", "user", "system", "max_rss", "minor_faults", "major_faults",
+                          "voluntary_switches", "involuntary_switches", ""};
+  SEXP out = PROTECT(mkNamed(REALSXP, names));
+  for(int i = 0; i < Rf_length(out); i++)
+    REAL(out)[i] = NA_REAL;
+  FILETIME created, exited, kernel, user;
+  if(GetProcessTimes(proc, &created, &exited, &kernel, &user)){
+    REAL(out)[0] = filetime_seconds(exited) - filetime_seconds(created);
+    REAL(out)[1] = filetime_seconds(user);
+    REAL(out)[2] = filetime_seconds(kernel);
+  }
+  UNPROTECT(1);
+  return out;
+}
+
 static BOOL CALLBACK closeWindows(HWND hWnd, LPARAM lpid) {
   DWORD pid = (DWORD)lpid;
   DWORD win;
@@ -192,7 +253,7 @@ static SEXP make_handle_ptr(HANDLE proc){
   return ptr;
 }
 
-SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SEXP wait, SEXP timeout){
+SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SEXP wait, SEXP timeout, SEXP options){
   int block = asLogical(wait);
   SECURITY_ATTRIBUTES sa;
   sa.nLength = sizeof(sa);
@@ -241,7 +302,11 @@ SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SE
   */
 
   //printf("ARGV: %S\n", argv); //NOTE capital %S for formatting wchar_t str
-  if(!CreateProcessW(NULL, argv, &sa, &sa, TRUE, dwCreationFlags, NULL, NULL, &si, &pi)){
+  double spawned = timestamp();
+  BOOL created = CreateProcessW(NULL, argv, &sa, &sa, TRUE, dwCreationFlags, NULL, NULL, &si, &pi);
+  stats[0] += created;
+  stats[1] += timestamp() - spawned;
+  if(!created){
     //Failure to start, probably non existing program. Cleanup.
     const char *errmsg = formatError(GetLastError());
     CloseHandle(pipe_out); CloseHandle(pipe_err);
@@ -273,11 +338,11 @@ SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SE
 
   //start timer
   int timeout_reached = 0;
-  struct timeval start, end;
   double totaltime = REAL(timeout)[0];
-  gettimeofday(&start, NULL);
+  ULONGLONG start = GetTickCount64();
 
   int res = pid;
+  SEXP rusage = R_NilValue;
   if(block){
     int running = 1;
     while(running){
@@ -288,8 +353,7 @@ SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SE
 
       //check for timeout
       if(totaltime > 0){
-        gettimeofday(&end, NULL);
-        timeout_reached = ((end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6) > totaltime;
+        timeout_reached = (GetTickCount64() - start) / 1000.0 > totaltime;
       }
       if(pending_interrupt() || timeout_reached){
         running = 0;
@@ -308,6 +372,8 @@ SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SE
       }
     }
     DWORD exit_code;
+    if(IS_TRUE(get_option(options, "rusage")))
+      rusage = PROTECT(make_rusage(proc));
     warn_if(!CloseHandle(pipe_out), "CloseHandle pipe_out");
     warn_if(!CloseHandle(pipe_err), "CloseHandle pipe_err");
     warn_if(GetExitCodeProcess(proc, &exit_code) == 0, "GetExitCodeProcess");
@@ -329,17 +395,19 @@ SEXP C_execute(SEXP command, SEXP args, SEXP outfun, SEXP errfun, SEXP input, SE
                  CHAR(STRING_ELT(command, 0)), totaltime);
   }
   SEXP out = PROTECT(ScalarInteger(res));
+  if(rusage != R_NilValue)
+    setAttrib(out, install("rusage"), rusage);
   if(!block){
     setAttrib(out, install("handle"), make_handle_ptr(proc));
     if(use_job){
       setAttrib(out, install("job"), make_handle_ptr(job));
     }
   }
-  UNPROTECT(1);
+  UNPROTECT(rusage != R_NilValue ? 2 : 1);
   return out;
 }
 
-SEXP R_exec_status(SEXP rpid, SEXP wait){
+SEXP R_exec_status(SEXP rpid, SEXP wait, SEXP options){
   DWORD exit_code = NA_INTEGER;
   int pid = asInteger(rpid);
   HANDLE proc = OpenProcess(PROCESS_QUERY_INFORMATION | SYNCHRONIZE, FALSE, pid);
@@ -351,6 +419,79 @@ SEXP R_exec_status(SEXP rpid, SEXP wait){
       break;
   } while(asLogical(wait) && !pending_interrupt());
   warn_if(GetExitCodeProcess(proc, &exit_code) == 0, "GetExitCodeProcess");
+  SEXP out = PROTECT(ScalarInteger(exit_code == STILL_ACTIVE ? NA_INTEGER : exit_code));
+  if(exit_code != STILL_ACTIVE && IS_TRUE(get_option(options, "rusage")))
+    setAttrib(out, install("rusage"), make_rusage(proc));
   CloseHandle(proc);
-  return ScalarInteger(exit_code == STILL_ACTIVE ? NA_INTEGER : exit_code);
+  UNPROTECT(1);
+  return out;
+}
+
+/* exec_parallel() runs jobs sequentially on Windows (see R/parallel.R) */
+SEXP R_exec_parallel(SEXP commands, SEXP argvs, SEXP outfuns, SEXP errfuns, SEXP inputs,
+                     SEXP timeouts, SEXP max_jobs, SEXP options){
+  Rf_error("R_exec_parallel is not supported on Windows");
+}
+
+/* The fork server forks a helper process, which needs fork() */
+SEXP R_forkserver_start(SEXP helper){
+  Rf_error("The fork server is only supported on Linux");
+}
+
+SEXP R_forkserver_stop(void){
+  return ScalarLogical(FALSE);
+}
+
+/* exec_pipeline() runs the stages one by one in R on Windows */
+SEXP R_exec_pipeline(SEXP commands, SEXP argvs, SEXP outfun, SEXP errfun, SEXP input,
+                     SEXP timeout, SEXP options){
+  Rf_error("Pipelines are not supported on Windows");
+}
+
+/* Process handles need poll() and are not available on Windows */
+SEXP R_exec_process(SEXP command, SEXP args, SEXP input, SEXP options){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+SEXP R_process_kill(SEXP ptr, SEXP signal){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+SEXP R_process_poll(SEXP handles, SEXP timeout){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+SEXP R_process_read(SEXP ptr){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+SEXP R_process_wait(SEXP ptr, SEXP timeout){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+SEXP R_process_fds(SEXP ptr){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+SEXP R_process_write(SEXP ptr, SEXP data, SEXP close_input){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+SEXP R_process_send(SEXP ptr, SEXP data, SEXP offset){
+  Rf_error("Process handles are not supported on Windows");
+}
+
+/* exec_internal() on Windows collects output with connections */
+void memfd_init(DllInfo * dll){}
+
+SEXP R_cache_key(SEXP fields, SEXP input){
+  Rf_error("The result cache is not supported on Windows");
+}
+
+SEXP R_cache_lookup(SEXP dir, SEXP key){
+  Rf_error("The result cache is not supported on Windows");
+}
+
+SEXP R_cache_store(SEXP dir, SEXP key, SEXP status, SEXP out, SEXP err, SEXP max_size){
+  Rf_error("The result cache is not supported on Windows");
 }